@@ -13,82 +13,647 @@
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
+#include "alarm.h"
+#include "queue.h"
+#include "prof.h"
+#include "trace.h"
+#include "flightrec.h"
+#include "metrics.h"
+#include "ctl.h"
+#include "await.h"
+#include "launcher.h"
+#include "output.h"
+#include "intake.h"
+#include "batch.h"
+#include "cgroup.h"
+#include "pipeline.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <stdio.h>
 
 
 #define DISPLAY_ONE 1
 #define DISPLAY_TWO 2
 #define PRINT_INTERVAL 2
-#define DATEFORMAT_SIZE 50
-/*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
- */
-typedef struct alarm_tag {
-    struct alarm_tag    *link;
-    int                 seconds;
-    struct timespec     time;   /* seconds from EPOCH */
-    char                message[64];
-    char                time_retrieved[DATEFORMAT_SIZE];
-} alarm_t;
+//Default staging horizon in seconds, see queue.h
+#define STAGE_HORIZON 10
+//Alarms listed per display thread by "range list"
+#define RANGE_LIST_MAX 100
+//Input sources besides stdin, see -i
+#define INPUT_MAX 8
+//An idle display thread sleeps at most this long, so staged alarms are promoted in time
+#define DISPLAY_IDLE_USEC 500000LL
+//and wakes this long before its head is due, to poll for the rest
+#define DISPLAY_SPIN_USEC 200LL
+//Buckets, each with its own lock, of alarms on their way to a shard
+#define TRANSIT_BUCKETS 64
 
 //Structure to pass onto display thread
-//Contains a thread number, the alarm list specific to the thread, and the latest request in the
+//Contains a thread number, the alarm queue specific to the thread, and the latest request in the
 typedef struct display_struct {
     int thread_num;
-    alarm_t * alarm_list;
-    alarm_t * latest_request;
+    //Lock for the queue, shared by the alarm thread inserting, the
+    //display thread firing and main cancelling
+    pthread_mutex_t lock;
+    queue_t queue;
+    //The latest request, copied by the alarm thread under the lock:
+    //the alarm may be cancelled and freed before it is reported
+    unsigned long latest_id;
+    int latest_seconds;
+    char latest_message[64];
+    struct timespec latest_deadline;
+    //Deadline the display thread is sleeping towards, usec since the
+    //Epoch (LLONG_MAX for none), and the futex word it sleeps on
+    long long earliest;
+    int wake;
 
 } disp_t;
 
 
-//MUTEX for alarm thread
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 //MUTEX for display threads
 pthread_mutex_t display_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-//Global alarm list. this list should be written into then deleted from.
-alarm_t *alarm_list = NULL;
+//Sequence for alarm ids
+unsigned long next_id = 0;
+
+//Alarms on their way from the parsers to the alarm thread
+intake_t intake;
+//Chain steps on their way back from the display threads
+intake_t chain_intake;
+
+//Alarms on either of those, by id, linked through id_link, so cancel
+//and await find them before they reach a shard. A bucket's lock is
+//always taken before any shard lock.
+typedef struct transit_bucket {
+    pthread_mutex_t lock;
+    alarm_t * alarms;
+} transit_t;
+transit_t transit[TRANSIT_BUCKETS];
+
+//An input source other than stdin, with the thread parsing it
+typedef struct input {
+    int index;
+    const char * path;
+    pthread_t thread;
+} input_t;
+//Number of them; stdin only waits for each alarm to be received when there are none
+int input_count = 0;
+//Name the current parser thread prints its submissions under
+__thread char parser_name[DATEFORMAT_SIZE] = "Main Thread";
+
+//The structures to pass data to the display threads.
+//Set up by the alarm thread, main uses them to cancel.
+disp_t * display_one = NULL, * display_two = NULL;
+//Seconds per staging period, 0 puts every alarm straight on the list
+int stage_horizon = STAGE_HORIZON;
+//Backend the shard queues keep their alarms in, or QUEUE_ADAPTIVE
+int queue_backend = QUEUE_LIST;
 
 //Display flag
 volatile int display_flag = 0;
-//Alarm flag
+//Set once the alarm thread has set up both display structures
+volatile int shards_ready = 0;
+//Alarms submitted that no display thread has received yet
 volatile int alarm_flag = 0;
 //Date format
 const char* date_format_string = "%Y-%m-%d %H:%M:%S";
 
-/* Appends to the list of alarms, sorted by smallest time.
- *
- * If the alarm item finishes sooner than the old alarm,
- * Append to it before
+long long timespec_usec(const struct timespec * time){
+    return (long long)time->tv_sec * 1000000LL + time->tv_nsec / 1000;
+}
+
+/* Called with the shard lock held, once alarm is queued. If it is
+ * due before anything the display thread is sleeping towards, it is
+ * published as the shard's earliest deadline and 1 is returned: the
+ * display thread has to be woken, by shard_wake once the lock is
+ * dropped. Otherwise the display thread sleeps on undisturbed.
  */
-void appendToList(alarm_t ** base_list, alarm_t * new_item){
+int shard_publish(disp_t * display, alarm_t * alarm){
+    struct timespec deadline = queue_deadline(&display->queue, alarm);
+    long long usec = timespec_usec(&deadline);
 
-    alarm_t * old = *base_list;
+    if(usec >= display->earliest){
+        metrics_wakeup(0);
+        return 0;
+    }
+    __atomic_store_n(&display->earliest, usec, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&display->wake, 1, __ATOMIC_RELEASE);
+    metrics_wakeup(1);
+    return 1;
+}
 
+void shard_wake(disp_t * display){
+    syscall(SYS_futex, &display->wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
 
-    while (*base_list != NULL) {
-        //If before another item, append.
-        if (new_item->time.tv_sec <= old->time.tv_sec) {
-            new_item->link = old;
+/* Sleep the display thread until until (usec since the Epoch) or a
+ * wakeup, whichever is first. seq is the wake word as read under the
+ * shard lock, so a wakeup since then is not missed. The last
+ * DISPLAY_SPIN_USEC are polled rather than slept.
+ */
+void shard_sleep(disp_t * display, int seq, long long until){
+    struct timespec now, timeout;
+    long long left;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    left = until - timespec_usec(&now) - DISPLAY_SPIN_USEC;
+    if(left <= 0){
+        cgroup_relax();
+        return;
+    }
+    timeout.tv_sec = left / 1000000;
+    timeout.tv_nsec = left % 1000000 * 1000;
+    syscall(SYS_futex, &display->wake, FUTEX_WAIT_PRIVATE, seq, &timeout, NULL, 0);
+}
 
-            *base_list = new_item;
-            break;
+/* Insert an alarm into a display thread's queue.
+ */
+void shard_insert(disp_t * display, alarm_t * alarm){
+    struct timespec now;
+    int woken;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    trace_lock(&display->lock, "wait shard lock");
+    queue_insert(&display->queue, alarm, now.tv_sec);
+    woken = shard_publish(display, alarm);
+    pthread_mutex_unlock(&display->lock);
+    if(woken)
+        shard_wake(display);
+}
+
+/* The display thread an alarm due at time belongs to: odd seconds,
+ * rounded, go to display one and even ones to display two.
+ */
+int shard_number(const struct timespec * time){
+    time_t second = time->tv_sec;
+
+    if(time->tv_nsec >= 500000000L)
+        second++;
+    return second % 2 == 0 ? DISPLAY_TWO : DISPLAY_ONE;
+}
+
+disp_t * shard_for(const struct timespec * time){
+    return shard_number(time) == DISPLAY_TWO ? display_two : display_one;
+}
+
+/* Render what the display thread prints when the alarm fires, or
+ * for an alarm from the stats socket what it sends back, from the
+ * alarm's id, time and message. Done by whoever submits the alarm,
+ * so the display threads only copy it.
+ */
+void render_expiry(alarm_t * alarm){
+    struct tm local_time;
+    char local_str[DATEFORMAT_SIZE];
+
+    if(localtime_r(&alarm->time.tv_sec, &local_time) == NULL)
+        fprintf(stderr, "Error Acquiring local time\n");
+    strftime(local_str, DATEFORMAT_SIZE, date_format_string, &local_time);
+
+    if(alarm->origin != 0)
+        alarm->expiry_length = snprintf(alarm->expiry, EXPIRY_SIZE, "expired %lu at %s: %s\n",
+                                        alarm->id, local_str, alarm->message);
+    else
+        alarm->expiry_length = snprintf(alarm->expiry, EXPIRY_SIZE,
+                                        "\nDisplay Thread  %d: Alarm expired at %s: %s\nalarm>",
+                                        shard_number(&alarm->time), local_str, alarm->message);
+    if(alarm->expiry_length >= EXPIRY_SIZE)
+        alarm->expiry_length = EXPIRY_SIZE - 1;
+}
+
+transit_t * transit_bucket(unsigned long id){
+    return &transit[id % TRANSIT_BUCKETS];
+}
+
+//Where the alarm with this id is linked in its bucket; the bucket locked
+alarm_t ** transit_find(transit_t * bucket, unsigned long id){
+    alarm_t ** chain = &bucket->alarms;
+
+    while(*chain != NULL && (*chain)->id != id)
+        chain = &(*chain)->id_link;
+    return chain;
+}
+
+//Note an alarm as on its way to a shard; its bucket locked
+void transit_enter(transit_t * bucket, alarm_t * alarm){
+    alarm->state = ALARM_TRANSIT;
+    alarm->id_link = bucket->alarms;
+    bucket->alarms = alarm;
+}
+
+/* Take an alarm that has got to its shard off its bucket, which is
+ * locked until it is on the shard. Returns 0, or -1 if it was
+ * cancelled on the way and is the caller's to free.
+ */
+int transit_leave(transit_t * bucket, alarm_t * alarm){
+    alarm_t ** chain;
+
+    if(alarm->state == ALARM_CANCELLED)
+        return -1;
+    chain = transit_find(bucket, alarm->id);
+    if(*chain != NULL)
+        *chain = alarm->id_link;
+    alarm->id_link = NULL;
+    alarm->state = ALARM_UNQUEUED;
+    return 0;
+}
+
+/* Run the next step of a chain from the display thread that fired
+ * the last one: the same alarm, id and all, due chain_seconds after
+ * the step that just fired. No parsing, no allocation and no handoff
+ * through main; the alarm thread renders its expiry record and puts
+ * it on its shard, see chain_drain, so firing only ever copies one.
+ * The display thread noted it in transit before it let go of the
+ * shard lock, so cancel and await find it all the way.
+ */
+void chain_alarm(alarm_t * alarm){
+    alarm->chain_steps--;
+    alarm->seconds = alarm->chain_seconds;
+    alarm->time.tv_sec += alarm->chain_seconds;
+    intake_push(&chain_intake, alarm);
+}
+
+/* Put the chain steps the display threads passed back on the shards
+ * they belong to, from the alarm thread. Returns how many there were.
+ */
+int chain_drain(void){
+    transit_t * bucket;
+    alarm_t * alarm;
+    int count = 0;
+
+    while((alarm = intake_pop(&chain_intake)) != NULL){
+        bucket = transit_bucket(alarm->id);
+        trace_lock(&bucket->lock, "wait transit lock");
+        if(transit_leave(bucket, alarm) != 0){
+            pthread_mutex_unlock(&bucket->lock);
+            free(alarm);
+            continue;
         }
-        base_list = &((*base_list)->link);
-        old = *base_list;
+        render_expiry(alarm);
+        shard_insert(shard_for(&alarm->time), alarm);
+        pthread_mutex_unlock(&bucket->lock);
+        fr_record(FR_SUBMIT, alarm->seconds, alarm->id);
+        metrics_submit();
+        count++;
+    }
+    return count;
+}
+
+/* Flush hook for batched submissions: each shard's share of the
+ * batch goes on its queue under one hold of the shard lock.
+ */
+void shard_batch(alarm_t ** alarms, int count){
+    disp_t * displays[2] = { display_one, display_two };
+    alarm_t * mine[BATCH_MAX];
+    struct timespec now;
+    int i, j, found, woken;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for(i = 0; i < 2; i++){
+        found = woken = 0;
+        for(j = 0; j < count; j++)
+            if(shard_for(&alarms[j]->time) == displays[i])
+                mine[found++] = alarms[j];
+        if(found == 0)
+            continue;
+        trace_lock(&displays[i]->lock, "wait shard lock");
+        //Sorted and merged in one pass, see queue_insert_batch
+        queue_insert_batch(&displays[i]->queue, mine, found, now.tv_sec);
+        for(j = 0; j < found; j++){
+            woken |= shard_publish(displays[i], mine[j]);
+            fr_record(FR_SUBMIT, mine[j]->seconds, mine[j]->id);
+            metrics_submit();
+        }
+        pthread_mutex_unlock(&displays[i]->lock);
+        //One wakeup for the batch, at most
+        if(woken)
+            shard_wake(displays[i]);
+    }
+}
+
+/* Schedule an alarm from any thread in process, and return its id.
+ * It goes straight to its shard in the calling thread's next batch,
+ * see batch.h, without passing through the alarm thread.
+ */
+unsigned long schedule_alarm(int seconds, const char * message){
+    struct tm local_time;
+    alarm_t * alarm = malloc(sizeof(alarm_t));
+
+    if(alarm == NULL)
+        return 0;
+    alarm->seconds = seconds;
+    snprintf(alarm->message, sizeof(alarm->message), "%s", message);
+    alarm->origin = 0;
+    alarm->chain_steps = 0;
+    alarm->spread_ms = 0;
+    alarm->action = 0;
+    alarm->state = ALARM_UNQUEUED;
+    alarm->waiters = NULL;
+    clock_gettime(CLOCK_REALTIME, &alarm->time);
+    localtime_r(&alarm->time.tv_sec, &local_time);
+    strftime(alarm->time_retrieved, DATEFORMAT_SIZE, date_format_string, &local_time);
+    alarm->time.tv_sec += seconds;
+    alarm->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+    render_expiry(alarm);
+    batch_submit(alarm);
+    return alarm->id;
+}
+
+/* Cancel a pending alarm on whichever display thread holds it, or
+ * on its way to one. Returns 0 if it was found and freed, or will be
+ * when it gets there.
+ */
+int cancel_alarm(unsigned long id){
+    disp_t * displays[2] = { display_one, display_two };
+    transit_t * bucket = transit_bucket(id);
+    alarm_t * alarm = NULL, ** chain;
+    waiter_t * waiters;
+    int i;
+
+    //Held throughout, so the alarm can't reach a shard after we looked
+    trace_lock(&bucket->lock, "wait transit lock");
+    chain = transit_find(bucket, id);
+    if(*chain != NULL){
+        alarm = *chain;
+        *chain = alarm->id_link;
+        alarm->state = ALARM_CANCELLED;
+        waiters = alarm->waiters;
+        alarm->waiters = NULL;
+        pthread_mutex_unlock(&bucket->lock);
+        await_wake(&waiters, AWAIT_CANCELLED);
+        return 0;
+    }
+    for(i = 0; i < 2 && alarm == NULL; i++){
+        if(displays[i] == NULL)
+            continue;
+        trace_lock(&displays[i]->lock, "wait shard lock");
+        alarm = queue_cancel(&displays[i]->queue, id);
+        pthread_mutex_unlock(&displays[i]->lock);
+    }
+    pthread_mutex_unlock(&bucket->lock);
+
+    if(alarm == NULL)
+        return -1;
+    await_wake(&alarm->waiters, AWAIT_CANCELLED);
+    free(alarm);
+    return 0;
+}
+
+/* Put a waiter on the pending alarm with this id, see await.h.
+ * Done under the shard lock, so the alarm can't fire in between, or
+ * under its transit bucket's lock while it is on its way to a shard.
+ */
+int watch_alarm(unsigned long id, waiter_t * waiter){
+    disp_t * displays[2] = { display_one, display_two };
+    transit_t * bucket = transit_bucket(id);
+    alarm_t * alarm, ** chain;
+    int i;
+
+    trace_lock(&bucket->lock, "wait transit lock");
+    chain = transit_find(bucket, id);
+    alarm = *chain;
+    if(alarm != NULL){
+        waiter->next = alarm->waiters;
+        alarm->waiters = waiter;
+    }
+    for(i = 0; i < 2 && alarm == NULL; i++){
+        if(displays[i] == NULL)
+            continue;
+        trace_lock(&displays[i]->lock, "wait shard lock");
+        alarm = queue_find(&displays[i]->queue, id);
+        if(alarm != NULL){
+            waiter->next = alarm->waiters;
+            alarm->waiters = waiter;
+        }
+        pthread_mutex_unlock(&displays[i]->lock);
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return alarm == NULL ? -1 : 0;
+}
+
+/* "pause", "resume" and "shift <seconds>" act on every display
+ * thread. Each only moves its queue's epoch, however many alarms
+ * are pending.
+ */
+void schedule_command(const char * command, long seconds){
+    disp_t * displays[2] = { display_one, display_two };
+    struct timespec now;
+    int i;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for(i = 0; i < 2; i++){
+        if(displays[i] == NULL)
+            continue;
+        trace_lock(&displays[i]->lock, "wait shard lock");
+        if(strcmp(command, "pause") == 0)
+            queue_pause(&displays[i]->queue, &now);
+        else if(strcmp(command, "resume") == 0)
+            queue_resume(&displays[i]->queue, &now);
+        else
+            queue_shift(&displays[i]->queue, seconds);
+        //Every deadline moved: the display thread has to look again
+        __atomic_add_fetch(&displays[i]->wake, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&displays[i]->lock);
+        shard_wake(displays[i]);
     }
+}
 
-    //End of list reached
-    //Append new item to end of list
-    if (*base_list == NULL) {
-        *base_list = new_item;
+/* Parse a time for the range commands: "+<seconds>" from now,
+ * "HH:MM[:SS]" today, or seconds since the Epoch.
+ * Returns 0 on success.
+ */
+int parse_when(const char * text, struct timespec * when){
+    struct tm local_time;
+    int hour, minute, second = 0;
+    long value;
+
+    clock_gettime(CLOCK_REALTIME, when);
+    if(sscanf(text, "+%ld", &value) == 1){
+        when->tv_sec += value;
+        return 0;
+    }
+    if(sscanf(text, "%d:%d:%d", &hour, &minute, &second) >= 2){
+        if(localtime_r(&when->tv_sec, &local_time) == NULL)
+            return -1;
+        local_time.tm_hour = hour;
+        local_time.tm_min = minute;
+        local_time.tm_sec = second;
+        local_time.tm_isdst = -1;
+        when->tv_sec = mktime(&local_time);
+        when->tv_nsec = 0;
+        return when->tv_sec == -1 ? -1 : 0;
+    }
+    if(sscanf(text, "%ld", &value) == 1){
+        when->tv_sec = value;
+        when->tv_nsec = 0;
+        return 0;
+    }
+    return -1;
+}
+
+/* "range count|list|cancel <from> <to>" over every display thread:
+ * how many alarms are due in [from, to), which ones, or cancel them.
+ */
+void range_command(const char * line){
+    disp_t * displays[2] = { display_one, display_two };
+    char action[16], from_text[32], to_text[32];
+    char expiry_str[DATEFORMAT_SIZE];
+    struct timespec from, to, deadline;
+    struct tm local_time;
+    alarm_t * listed[RANGE_LIST_MAX];
+    alarm_t * cancelled, * next;
+    unsigned long total = 0, count;
+    int i, j, found;
+
+    if(sscanf(line, "range %15s %31s %31s", action, from_text, to_text) != 3
+       || parse_when(from_text, &from) != 0 || parse_when(to_text, &to) != 0
+       || (strcmp(action, "count") != 0 && strcmp(action, "list") != 0 && strcmp(action, "cancel") != 0)){
+        fprintf(stderr, "Bad command\n");
+        return;
+    }
+
+    flockfile(stdout);
+    for(i = 0; i < 2; i++){
+        if(displays[i] == NULL)
+            continue;
+        trace_lock(&displays[i]->lock, "wait shard lock");
+        if(strcmp(action, "count") == 0)
+            total += queue_range_count(&displays[i]->queue, &from, &to);
+        else if(strcmp(action, "list") == 0){
+            count = queue_range_count(&displays[i]->queue, &from, &to);
+            found = queue_range_list(&displays[i]->queue, &from, &to, listed, RANGE_LIST_MAX);
+            for(j = 0; j < found; j++){
+                deadline = queue_deadline(&displays[i]->queue, listed[j]);
+                localtime_r(&deadline.tv_sec, &local_time);
+                strftime(expiry_str, DATEFORMAT_SIZE, date_format_string, &local_time);
+                printf("Display thread %d: alarm %lu expires at %s: %s\n",
+                       displays[i]->thread_num, listed[j]->id, expiry_str, listed[j]->message);
+            }
+            if(count > (unsigned long)found)
+                printf("Display thread %d: and %lu more\n", displays[i]->thread_num, count - found);
+            total += count;
+        }
+        else {
+            cancelled = queue_range_cancel(&displays[i]->queue, &from, &to);
+            for(; cancelled != NULL; cancelled = next){
+                next = cancelled->link;
+                await_wake(&cancelled->waiters, AWAIT_CANCELLED);
+                free(cancelled);
+                total++;
+            }
+        }
+        pthread_mutex_unlock(&displays[i]->lock);
     }
+    printf("Main Thread: %lu alarms %s\n", total,
+           strcmp(action, "cancel") == 0 ? "cancelled" : "in range");
+    funlockfile(stdout);
+}
+
+/* Set an alarm due its seconds after now, and write that time into
+ * local_str for the receipt.
+ */
+void stamp_alarm(alarm_t * alarm, const struct timespec * now, char * local_str){
+    struct tm local_time, * err_check;
 
+    //Set alarm time
+    alarm->time = *now;
+    alarm->time.tv_sec += alarm->seconds;
+    //get the local time string
+    err_check = localtime_r(&(alarm->time.tv_sec),&local_time);
+    if(err_check == NULL)
+        fprintf(stderr, "Error Acquiring local time\n");
+
+    strftime(local_str,DATEFORMAT_SIZE,date_format_string,&local_time);
+
+    alarm->state = ALARM_UNQUEUED;
+    alarm->waiters = NULL;
+    //Filled in by the display thread when it receives the alarm
+    alarm->time_retrieved[0] = '\0';
+}
+
+/* Print the receipt for a stamped, numbered and rendered alarm and
+ * put it on the intake queue.
+ */
+unsigned long post_alarm(alarm_t * alarm, const char * local_str, unsigned long long stage_start){
+    unsigned long id = alarm->id;
+    transit_t * bucket;
+
+    flockfile(stdout);
+    //Output message to console
+    printf("%s Received Alarm Request %lu at %s: %d seconds with message: %s\n",
+           parser_name, alarm->id, local_str, alarm->seconds, alarm->message);
+    fflush(stdout);
+    funlockfile(stdout);
+
+    trace_alarm(alarm->id, TRACE_PARSE, stage_start);
+    fr_record(FR_SUBMIT, alarm->seconds, alarm->id);
+    metrics_submit();
+
+    //Counted before it can be received, so the count never goes below 0
+    __atomic_add_fetch(&alarm_flag, 1, __ATOMIC_RELEASE);
+    //Findable by id from here on, see cancel_alarm
+    bucket = transit_bucket(id);
+    trace_lock(&bucket->lock, "wait transit lock");
+    transit_enter(bucket, alarm);
+    pthread_mutex_unlock(&bucket->lock);
+    intake_push(&intake, alarm);
+    return id;
+}
+
+/* Hand an alarm, with its seconds, message and origin filled in,
+ * to the alarm thread, and return the id it was given. Any number
+ * of parsers, and the stats socket, submit at once through the
+ * intake queue.
+ */
+unsigned long submit_alarm(alarm_t * alarm, unsigned long long stage_start){
+    struct timespec now;
+    char local_str[DATEFORMAT_SIZE];
+
+    //Allocate the time
+    clock_gettime(CLOCK_REALTIME, &now);
+    stamp_alarm(alarm, &now, local_str);
+    alarm->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+    render_expiry(alarm);
+    return post_alarm(alarm, local_str, stage_start);
+}
+
+//An alarm sent on the stats socket; its expiry goes back down that connection
+unsigned long socket_submit(int seconds, const char * message, unsigned long origin){
+    alarm_t * alarm = malloc(sizeof(alarm_t));
+
+    if(alarm == NULL)
+        return 0;
+    alarm->seconds = seconds;
+    snprintf(alarm->message, sizeof(alarm->message), "%s", message);
+    alarm->origin = origin;
+    alarm->chain_steps = 0;
+    alarm->spread_ms = 0;
+    alarm->action = 0;
+    return submit_alarm(alarm, trace_now());
+}
+
+/* Register the calling thread with the profiler, the tracer,
+ * the flight recorder and the metrics sampler under its role.
+ */
+void register_thread(int role, int index){
+    char name[DATEFORMAT_SIZE];
+
+    if(role == PROF_ROLE_DISPLAY)
+        snprintf(name, DATEFORMAT_SIZE, "display shard %d", index);
+    else if(role == PROF_ROLE_DISPATCHER)
+        snprintf(name, DATEFORMAT_SIZE, "dispatcher");
+    else if(index > 0)
+        snprintf(name, DATEFORMAT_SIZE, "parser %d", index);
+    else
+        snprintf(name, DATEFORMAT_SIZE, "parser");
+
+    prof_register_thread(role, index);
+    trace_register_thread(name);
+    fr_register_thread(name);
+    metrics_register_thread(name);
 }
 
 /* Thread function for the display of the alarms
@@ -103,6 +668,14 @@ void * display_thread(void * args){
 
     //Reference to previous alarm to be free
     alarm_t * oldref;
+    //Its waiters, and the transit bucket of a chain's next step
+    waiter_t * waiters;
+    transit_t * bucket;
+    //Head of the queue, and the id of the head the print interval is for
+    alarm_t * head;
+    unsigned long shown_id = 0;
+    //Absolute time the head is due, queued times are relative to the queue epoch
+    struct timespec deadline;
     //the display struct.
     disp_t * display = (disp_t *) args;
     //Structure to acquire current time with nanosec precision
@@ -111,9 +684,16 @@ void * display_thread(void * args){
     double time_nsec, alarm_time;
     //Time printing struct;
     struct tm local_time, * err_check;
-    char local_time_str[DATEFORMAT_SIZE];
-    char expiration_str[DATEFORMAT_SIZE];
+    char expiration_str[DATEFORMAT_SIZE], received_str[DATEFORMAT_SIZE];
+    //Why the queue changed backend, and the one it left
+    char reason[128];
+    int backend;
+    //Trace timestamps
+    unsigned long long stage_start;
+    //Wake word as of the last look at the queue
+    int seq;
 
+    register_thread(PROF_ROLE_DISPLAY, display->thread_num);
 
     while (1){
 
@@ -124,94 +704,160 @@ void * display_thread(void * args){
          *
          * It is done this way due to sleep() pausing the entire thread.
          */
+        PROF_STAGE(PROF_STAGE_POLL);
         while(display->thread_num != display_flag){
-            if(display->alarm_list != NULL){
-
-                //Calculate the current time in seconds.
-                clock_gettime(CLOCK_REALTIME, &now);
-                time_nsec = ((double)now.tv_nsec) * 1e-9 + (double)now.tv_sec;
-
-                //Print flag is set in case we break out of the loop, then we know to
-                //re-set the time interval
-                if(print_flag == 0){
-                    flockfile(stdout);
-                    printf("Display thread %d: Number of SecondsLeft %d: Time:%s alarm request: number of seconds: %d message: %s\n",
-                           display->thread_num,
-                           display->alarm_list->time.tv_sec - now.tv_sec,
-                           display->alarm_list->time_retrieved,
-                           display->alarm_list->seconds,
-                           display->alarm_list->message);
-                    fflush(stdout);
-                    funlockfile(stdout);
-                    //Set the print time, rounding to seconds is okay
-                    print_time = now.tv_sec + PRINT_INTERVAL;
-                    //Set the precise alarm time.
-                    alarm_time = (double)display->alarm_list->time.tv_nsec*1e-9 + display->alarm_list->time.tv_sec;
-                    print_flag = 1;
-                    continue;
-                }
+            //Calculate the current time in seconds.
+            clock_gettime(CLOCK_REALTIME, &now);
+            time_nsec = ((double)now.tv_nsec) * 1e-9 + (double)now.tv_sec;
+
+            //Hold the queue lock while looking at the head, so it can't be
+            //cancelled and freed under us. Staged alarms now due are sorted in first.
+            pthread_mutex_lock(&display->lock);
+            queue_promote(&display->queue, now.tv_sec);
+            backend = queue_adapt(&display->queue, now.tv_sec, reason, sizeof(reason));
+            if(backend >= 0){
+                fr_record(FR_BACKEND, display->thread_num, display->queue.backend);
+                flockfile(stdout);
+                printf("\nDisplay thread %d: queue backend %s -> %s: %s\n",
+                       display->thread_num,
+                       queue_backend_name(backend),
+                       queue_backend_name(display->queue.backend),
+                       reason);
+                fflush(stdout);
+                funlockfile(stdout);
+            }
+            head = queue_head(&display->queue);
+            seq = __atomic_load_n(&display->wake, __ATOMIC_ACQUIRE);
+
+            //Do nothing if it's null or paused, until something is queued
+            if(head == NULL || display->queue.paused){
+                __atomic_store_n(&display->earliest, LLONG_MAX, __ATOMIC_RELEASE);
+                pthread_mutex_unlock(&display->lock);
+                shard_sleep(display, seq, timespec_usec(&now) + DISPLAY_IDLE_USEC);
+                continue;
+            }
 
-                //If the current time is greater than or equal to the target time
-                //Print and free.
-                if(time_nsec >= alarm_time){
-                    //Print alarm done and a newline for the user to display alarm
-                    //Get the local time
-                    err_check = localtime_r(&(display->alarm_list->time.tv_sec), &local_time);
-                    if(err_check == NULL)
-                        fprintf(stderr, "Error Acquiring local time\n");
+            //A different head, from an earlier insert or a cancel, needs a
+            //new print interval, as does a shift or a resume
+            deadline = queue_deadline(&display->queue, head);
+            //Inserts due after it need not wake us
+            __atomic_store_n(&display->earliest, timespec_usec(&deadline), __ATOMIC_RELEASE);
+            if(head->id != shown_id || (double)deadline.tv_nsec*1e-9 + deadline.tv_sec != alarm_time){
+                shown_id = head->id;
+                print_flag = 0;
+            }
 
-                    strftime(local_time_str, DATEFORMAT_SIZE, date_format_string, &local_time);
+            //Print flag is set in case we break out of the loop, then we know to
+            //re-set the time interval
+            if(print_flag == 0){
+                flockfile(stdout);
+                printf("Display thread %d: Number of SecondsLeft %d: Time:%s alarm request: number of seconds: %d message: %s\n",
+                       display->thread_num,
+                       deadline.tv_sec - now.tv_sec,
+                       head->time_retrieved,
+                       head->seconds,
+                       head->message);
+                fflush(stdout);
+                funlockfile(stdout);
+                //Set the print time, rounding to seconds is okay
+                print_time = now.tv_sec + PRINT_INTERVAL;
+                //Set the precise alarm time.
+                alarm_time = (double)deadline.tv_nsec*1e-9 + deadline.tv_sec;
+                print_flag = 1;
+                pthread_mutex_unlock(&display->lock);
+                continue;
+            }
 
+            //If the current time is greater than or equal to the target time
+            //Print and free.
+            if(time_nsec >= alarm_time){
+                //A chain's next step is noted in transit before the shard
+                //lets go of it. The bucket lock comes first, so only try it
+                bucket = NULL;
+                if(head->chain_steps > 0 && !head->action){
+                    bucket = transit_bucket(head->id);
+                    if(pthread_mutex_trylock(&bucket->lock) != 0){
+                        pthread_mutex_unlock(&display->lock);
+                        continue;
+                    }
+                }
+                //Once off the queue the alarm is ours alone, but for
+                //cancel and await while a chain step is in transit.
+                //This step's waiters are woken, later ones wait for the next
+                oldref = queue_pop(&display->queue);
+                waiters = oldref->waiters;
+                oldref->waiters = NULL;
+                if(bucket != NULL){
+                    transit_enter(bucket, oldref);
+                    pthread_mutex_unlock(&bucket->lock);
+                }
+                pthread_mutex_unlock(&display->lock);
+
+                PROF_STAGE(PROF_STAGE_FIRE);
+                stage_start = trace_now();
+                fr_record(FR_FIRE, (unsigned int)((time_nsec - alarm_time) * 1e6), oldref->id);
+                metrics_expire((long)((time_nsec - alarm_time) * 1e6));
+                //Off the queue, its time is its own deadline again
+                if(oldref->spread_ms > 0)
+                    metrics_spread((long)((time_nsec - (double)oldref->time.tv_nsec * 1e-9
+                                           - oldref->time.tv_sec) * 1e6),
+                                   oldref->spread_ms * 1000L);
+                //Print alarm done and a newline for the user to display alarm,
+                //as rendered when it was submitted. Alarms from the stats
+                //socket expire to their own connection
+                if(oldref->origin != 0){
+                    ctl_deliver(oldref->origin, oldref->expiry, oldref->expiry_length);
+                    trace_alarm(oldref->id, TRACE_FIRE, stage_start);
+                } else {
                     flockfile(stdout);
-                    printf("\nDisplay Thread  %d: Alarm expired at %s: %s\n",
-                           display->thread_num,
-                           local_time_str,
-                           display->alarm_list->message);
-                    printf("alarm>");
-                    fflush(stdout);
+                    fwrite_unlocked(oldref->expiry, 1, oldref->expiry_length, stdout);
+                    trace_alarm(oldref->id, TRACE_FIRE, stage_start);
+                    trace_flush(stdout, oldref->id);
                     funlockfile(stdout);
-                    oldref = display->alarm_list;
-
-                    //If there is a next item in the list, free the old reference and move to that one.
-                    if((display->alarm_list)->link != NULL){
-                        display->alarm_list = (display->alarm_list)->link;
-                        free(oldref);
-                    }
-                        //Otherwise, just free the reference and null.
-                    else {
-                        free(oldref);
-                        display->alarm_list = NULL;
-                    }
-                    //Set print flag to 0 to acquire new print interval
-                    print_flag = 0;
-                    continue;
                 }
 
-                // If the current time has finally reached the print time,
-                // Print. Note: Should be error checked.
-                // now should never actually excede print_time.
-                if(now.tv_sec >= print_time){
+                await_wake(&waiters, AWAIT_FIRED);
+                if(oldref->action)
+                    launcher_run(oldref);
+                else if(oldref->chain_steps > 0)
+                    chain_alarm(oldref);
+                else
+                    free(oldref);
+                //Set print flag to 0 to acquire new print interval
+                print_flag = 0;
+                shown_id = 0;
+                PROF_STAGE(PROF_STAGE_POLL);
+                continue;
+            }
 
-                    print_time = now.tv_sec + PRINT_INTERVAL;
+            // If the current time has finally reached the print time,
+            // Print. Note: Should be error checked.
+            // now should never actually excede print_time.
+            if(now.tv_sec >= print_time){
 
-                    flockfile(stdout);
-                    printf("\nDisplay thread %d: Number of SecondsLeft %d: Time:%s alarm request: number of seconds: %d message: %s",
-                           display->thread_num,
-                           display->alarm_list->time.tv_sec - now.tv_sec,
-                           display->alarm_list->time_retrieved,
-                           display->alarm_list->seconds,
-                           display->alarm_list->message);
-                    fflush(stdout);
-                    funlockfile(stdout);
+                print_time = now.tv_sec + PRINT_INTERVAL;
 
-                }
-            }
+                flockfile(stdout);
+                printf("\nDisplay thread %d: Number of SecondsLeft %d: Time:%s alarm request: number of seconds: %d message: %s",
+                       display->thread_num,
+                       deadline.tv_sec - now.tv_sec,
+                       head->time_retrieved,
+                       head->seconds,
+                       head->message);
+                fflush(stdout);
+                funlockfile(stdout);
 
-            //Do nothing if it's null
+            }
+            pthread_mutex_unlock(&display->lock);
+            //Until the head is due or the next print, whichever is first
+            shard_sleep(display, seq, print_time * 1000000LL < (long long)(alarm_time * 1e6)
+                        ? print_time * 1000000LL : (long long)(alarm_time * 1e6));
 
         }
         //Lock the display thread to make sure the append operation to the list is atomic.
-        pthread_mutex_lock(&display_mutex);
+        PROF_STAGE(PROF_STAGE_RECEIVE);
+        trace_lock(&display_mutex, "wait display_mutex");
+        stage_start = trace_now();
 
         //Set time
         clock_gettime(CLOCK_REALTIME, &now);
@@ -222,10 +868,10 @@ void * display_thread(void * args){
             fprintf(stderr, "Error Acquiring local time\n");
 
 
-        strftime(display->latest_request->time_retrieved,DATEFORMAT_SIZE,date_format_string,&local_time);
+        strftime(received_str,DATEFORMAT_SIZE,date_format_string,&local_time);
 
         //Get time alarm expires
-        err_check = localtime_r(&(display->alarm_list->time.tv_sec), &local_time);
+        err_check = localtime_r(&(display->latest_deadline.tv_sec), &local_time);
         if(err_check == NULL)
             fprintf(stderr, "Error Acquiring local time\n");
 
@@ -234,18 +880,20 @@ void * display_thread(void * args){
         //Display the last request received.
         printf("Display thread %d: Received Alarm Request at time %s: number of seconds: %d message: %s, ExpiryTime is %s\n",
                display->thread_num,
-               display->latest_request->time_retrieved,
-               display->latest_request->seconds,
-               display->latest_request->message,
+               received_str,
+               display->latest_seconds,
+               display->latest_message,
                expiration_str);
 
+        trace_alarm(display->latest_id, TRACE_ENQUEUE, stage_start);
+        fr_record(FR_RECEIVE, display->thread_num, display->latest_id);
 
         //Unlock the display mutex.
         pthread_mutex_unlock(&display_mutex);
         //Unlock the display flag back to the alarm thread
         display_flag = 0;
-        //Unlock the main thread print
-        alarm_flag = 0;
+        //One fewer for stdin to wait for
+        __atomic_sub_fetch(&alarm_flag, 1, __ATOMIC_RELEASE);
 
 
         print_flag = 0;
@@ -260,8 +908,6 @@ void *alarm_thread (void *arg)
 {
     alarm_t *alarm;
     int status;
-    //The structures to pass data to the display threads.
-    disp_t * display_one, * display_two;
     //The threads
     pthread_t display_thread1, display_thread2;
     //Precision time checks.
@@ -270,6 +916,17 @@ void *alarm_thread (void *arg)
     //String format time
     struct tm alarm_local_time, * err_check;
     char alarm_local_str[DATEFORMAT_SIZE];
+    //Trace timestamp
+    unsigned long long stage_start;
+    //Shard the alarm went to
+    disp_t * target;
+    //Its transit bucket, locked while it moves onto the shard
+    transit_t * bucket;
+    //Receipt and expiry, when reported here rather than by the display thread
+    struct timespec now, deadline;
+    struct tm received_time;
+    char expiration_str[DATEFORMAT_SIZE];
+    int woken;
 
 
     //Set the struct for the first thread
@@ -278,15 +935,28 @@ void *alarm_thread (void *arg)
         err_abort(EXIT_FAILURE, "Display one allocation failed");
 
     display_one->thread_num = DISPLAY_ONE;
-    display_one->alarm_list = NULL;
+    pthread_mutex_init(&display_one->lock, NULL);
+    queue_init(&display_one->queue, stage_horizon);
+    queue_set_backend(&display_one->queue, queue_backend);
+    display_one->earliest = LLONG_MAX;
+    display_one->wake = 0;
 
     //Set the struct for the second thread
     display_two = malloc(sizeof(disp_t));
     if(display_two == NULL)
         err_abort(EXIT_FAILURE, "Display two allocation failed");
 
-    display_two->alarm_list = NULL;
+    pthread_mutex_init(&display_two->lock, NULL);
+    queue_init(&display_two->queue, stage_horizon);
+    queue_set_backend(&display_two->queue, queue_backend);
+    display_two->earliest = LLONG_MAX;
+    display_two->wake = 0;
     display_two->thread_num = DISPLAY_TWO;
+    __atomic_store_n(&shards_ready, 1, __ATOMIC_RELEASE);
+
+    register_thread(PROF_ROLE_DISPATCHER, 0);
+    metrics_register_shard(DISPLAY_ONE, &display_one->queue.depth);
+    metrics_register_shard(DISPLAY_TWO, &display_two->queue.depth);
 
     //Create thread one
     status = pthread_create (
@@ -306,17 +976,30 @@ void *alarm_thread (void *arg)
      */
     while (1) {
         //Check for the flag to see whether a display thread is currently performing an operation.
-        while(display_flag != 0);
+        PROF_STAGE(PROF_STAGE_WAIT);
+        while(display_flag != 0)
+            cgroup_relax();
         //Lock the display mutex.
-        pthread_mutex_lock(&display_mutex);
-        //Block thread until main thread has actually receive a request.
-        while(alarm_flag == 0);
-        alarm = alarm_list;
-        //Receive mutex to assure mutual exclusion.
-        status = pthread_mutex_lock (&alarm_mutex); //Block
-        if (status != 0)
-            err_abort (status, "Lock mutex");
-
+        trace_lock(&display_mutex, "wait display_mutex");
+        //Block thread until a parser has actually submitted a request,
+        //seeing to chain steps first so a busy intake can't hold them up
+        chain_drain();
+        while((alarm = intake_pop(&intake)) == NULL)
+            if(chain_drain() == 0)
+                cgroup_relax();
+
+        PROF_STAGE(PROF_STAGE_DISPATCH);
+        stage_start = trace_now();
+        //Held until the alarm is on its shard, unless it was cancelled on the way
+        bucket = transit_bucket(alarm->id);
+        trace_lock(&bucket->lock, "wait transit lock");
+        if(transit_leave(bucket, alarm) != 0){
+            pthread_mutex_unlock(&bucket->lock);
+            free(alarm);
+            __atomic_sub_fetch(&alarm_flag, 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&display_mutex);
+            continue;
+        }
         nano_time = (float)alarm->time.tv_nsec*1e-9;
         sec_time = alarm->time.tv_sec;
 
@@ -335,52 +1018,527 @@ void *alarm_thread (void *arg)
 
         //If the time is even, send to display two, otherwise
         //Send to display one
-        if((sec_time % 2) == 0) {
-            display_flag = DISPLAY_TWO;
-            appendToList(&(display_two->alarm_list), alarm);
-            display_two->latest_request = alarm;
+        target = (sec_time % 2) == 0 ? display_two : display_one;
+
+        //Stamp the time the request was received
+        clock_gettime(CLOCK_REALTIME, &now);
+        err_check = localtime_r(&(now.tv_sec), &received_time);
+        if(err_check == NULL)
+            fprintf(stderr, "Error Acquiring local time\n");
+        strftime(alarm->time_retrieved, DATEFORMAT_SIZE, date_format_string, &received_time);
+
+        trace_lock(&target->lock, "wait shard lock");
+        queue_insert(&target->queue, alarm, now.tv_sec);
+        woken = shard_publish(target, alarm);
+        if(woken){
+            //Due before anything the display thread is sleeping towards:
+            //hand it over, and the display thread reports the receipt
+            target->latest_id = alarm->id;
+            target->latest_seconds = alarm->seconds;
+            memcpy(target->latest_message, alarm->message, sizeof(alarm->message));
+            target->latest_deadline = queue_deadline(&target->queue, alarm);
+            display_flag = target->thread_num;
             printf("Alarm Thread passed Alarm Request to Display Thread %d at %s: number of seconds: %d message: %s\n",
-                   DISPLAY_TWO,
+                   target->thread_num,
                    alarm_local_str,
                    alarm->seconds,
                    alarm->message);
-        }
-        else {
-            display_flag = DISPLAY_ONE;
-            appendToList(&(display_one->alarm_list), alarm);
-            display_one->latest_request = alarm;
+        } else {
+            //Otherwise leave the display thread asleep and report the
+            //receipt on its behalf. The shard lock keeps the alarm from
+            //firing, and being freed, until it has been printed
+            deadline = queue_deadline(&target->queue, alarm);
+            err_check = localtime_r(&(deadline.tv_sec), &received_time);
+            if(err_check == NULL)
+                fprintf(stderr, "Error Acquiring local time\n");
+            strftime(expiration_str, DATEFORMAT_SIZE, date_format_string, &received_time);
+
             printf("Alarm Thread passed Alarm Request to Display Thread %d at %s: number of seconds: %d message: %s\n",
-                   DISPLAY_ONE,
+                   target->thread_num,
                    alarm_local_str,
                    alarm->seconds,
                    alarm->message);
+            printf("Display thread %d: Received Alarm Request at time %s: number of seconds: %d message: %s, ExpiryTime is %s\n",
+                   target->thread_num,
+                   alarm->time_retrieved,
+                   alarm->seconds,
+                   alarm->message,
+                   expiration_str);
+            trace_alarm(alarm->id, TRACE_ENQUEUE, stage_start);
+            fr_record(FR_RECEIVE, target->thread_num, alarm->id);
+            //One fewer for stdin to wait for
+            __atomic_sub_fetch(&alarm_flag, 1, __ATOMIC_RELEASE);
         }
-        //Get rid of the reference.
-        alarm_list = NULL;
+        fr_record(FR_DISPATCH, target->thread_num, alarm->id);
+        fr_record(FR_QUEUE_DEPTH, target->thread_num,
+                  __atomic_load_n(&target->queue.depth, __ATOMIC_RELAXED));
+        trace_alarm(alarm->id, TRACE_DISPATCH, stage_start);
+        pthread_mutex_unlock(&target->lock);
+        pthread_mutex_unlock(&bucket->lock);
+        if(woken)
+            shard_wake(target);
 
         //Unlock the display thread that received the request.
         status = pthread_mutex_unlock(&display_mutex);
         if (status != 0)
             err_abort (status, "Unlock display mutex");
 
+    }
+}
 
-        //Unlock the main thread after the transaction.
-        status = pthread_mutex_unlock (&alarm_mutex);
-        if (status != 0)
-            err_abort (status, "Unlock mutex");
+/* Carry out one line of input: a command, or an alarm request to
+ * submit. Called by main for stdin and by each input thread.
+ */
+void parse_command(char * line, unsigned long long stage_start){
+    alarm_t *alarm;
+    char dump_path[128];
+    int seconds;
+    //Alarm to cancel or await
+    unsigned long cancel_id;
+    long shift_seconds;
+
+    /*
+     * "profile" prints the per-stage summary, "profile <file>"
+     * writes folded stacks for a flame graph.
+     */
+    if (strncmp (line, "profile", 7) == 0) {
+        if (sscanf (line, "profile %127s", dump_path) == 1) {
+            if (prof_dump_folded (dump_path) != 0)
+                fprintf (stderr, "Profile dump to %s failed\n", dump_path);
+        } else
+            prof_dump (stdout);
+        return;
+    }
+
+    //"trace" writes the trace file without waiting for exit
+    if (strncmp (line, "trace", 5) == 0) {
+        if (trace_write () != 0)
+            fprintf (stderr, "Trace not written, start with -t <file>\n");
+        return;
+    }
+
+    //"stats" and "history [seconds]" answer the same as the stats socket
+    if (strncmp (line, "stats", 5) == 0) {
+        flockfile(stdout);
+        metrics_stats (stdout);
+        output_stats (stdout);
+        batch_stats (stdout);
+        cgroup_stats (stdout);
+        pipeline_stats (stdout);
+        funlockfile(stdout);
+        return;
+    }
+    if (strncmp (line, "history", 7) == 0) {
+        if (sscanf (line, "history %d", &seconds) != 1)
+            seconds = 0;
+        flockfile(stdout);
+        metrics_history (stdout, seconds);
+        funlockfile(stdout);
+        return;
+    }
+
+    //"cancel <id>" drops a pending alarm
+    if (strncmp (line, "cancel", 6) == 0) {
+        if (sscanf (line, "cancel %lu", &cancel_id) != 1)
+            fprintf (stderr, "Bad command\n");
+        else if (cancel_alarm (cancel_id) != 0)
+            fprintf (stderr, "No pending alarm %lu\n", cancel_id);
+        else
+            printf ("Main Thread cancelled alarm %lu\n", cancel_id);
+        return;
+    }
+
+    //"await <id>" blocks the prompt until the alarm fires or is cancelled
+    if (strncmp (line, "await", 5) == 0) {
+        if (sscanf (line, "await %lu", &cancel_id) != 1)
+            fprintf (stderr, "Bad command\n");
+        else
+            printf ("Main Thread: alarm %lu %s\n", cancel_id,
+                    await_outcome_name (await_alarm (cancel_id)));
+        return;
+    }
+
+    if (strncmp (line, "range", 5) == 0) {
+        range_command (line);
+        return;
+    }
+
+    //"pause", "resume" and "shift <seconds>" move the whole schedule
+    if (strncmp (line, "pause", 5) == 0 || strncmp (line, "resume", 6) == 0) {
+        line[strcspn (line, " \n")] = '\0';
+        schedule_command (line, 0);
+        printf ("Main Thread %s all alarms\n", strcmp (line, "pause") == 0 ? "paused" : "resumed");
+        return;
+    }
+    if (strncmp (line, "shift", 5) == 0) {
+        if (sscanf (line, "shift %ld", &shift_seconds) != 1)
+            fprintf (stderr, "Bad command\n");
+        else {
+            schedule_command ("shift", shift_seconds);
+            printf ("Main Thread shifted all alarms by %ld seconds\n", shift_seconds);
+        }
+        return;
+    }
+    //"schedule <seconds> <message>" takes the batched in-process path
+    if (strncmp (line, "schedule", 8) == 0) {
+        if (sscanf (line, "schedule %d %64[^\n]", &seconds, dump_path) < 2 || seconds < 0)
+            fprintf (stderr, "Bad command\n");
+        else
+            printf ("%s scheduled alarm %lu\n", parser_name, schedule_alarm (seconds, dump_path));
+        return;
+    }
+
+    alarm = (alarm_t*)malloc (sizeof (alarm_t));
+    if (alarm == NULL)
+        errno_abort ("Allocate alarm");
+    alarm->origin = 0;
+    alarm->chain_steps = 0;
+    alarm->spread_ms = 0;
+    alarm->action = 0;
+
+    //"exec <seconds> <command>" runs command when the alarm fires
+    if (strncmp (line, "exec", 4) == 0) {
+        if (!launcher_started ()) {
+            fprintf (stderr, "No launcher, start with -L <n>\n");
+            free (alarm);
+            return;
+        }
+        if (sscanf (line, "exec %d %63[^\n]", &alarm->seconds, alarm->message) < 2) {
+            fprintf (stderr, "Bad command\n");
+            free (alarm);
+            return;
+        }
+        alarm->action = 1;
+        submit_alarm (alarm, stage_start);
+        return;
+    }
+
+    /*
+     * "chain <steps> <seconds> <message>" fires every seconds,
+     * steps times, rescheduled by the display threads themselves.
+     */
+    if (strncmp (line, "chain", 5) == 0) {
+        if (sscanf (line, "chain %d %d %63[^\n]", &alarm->chain_steps,
+                    &alarm->seconds, alarm->message) < 3
+            || alarm->chain_steps < 1 || alarm->seconds < 0) {
+            fprintf (stderr, "Bad command\n");
+            free (alarm);
+            return;
+        }
+        alarm->chain_seconds = alarm->seconds;
+        alarm->chain_steps--;
+        submit_alarm (alarm, stage_start);
+        return;
+    }
+
+    /*
+     * "spread <ms> <seconds> <message>" may fire up to ms late, so
+     * a crowd of alarms due together goes off across the window.
+     */
+    if (strncmp (line, "spread", 6) == 0) {
+        if (sscanf (line, "spread %d %d %63[^\n]", &alarm->spread_ms,
+                    &alarm->seconds, alarm->message) < 3
+            || alarm->spread_ms < 0 || alarm->spread_ms > SPREAD_MAX_MS || alarm->seconds < 0) {
+            fprintf (stderr, "Bad command\n");
+            free (alarm);
+            return;
+        }
+        submit_alarm (alarm, stage_start);
+        return;
+    }
+
+    /*
+     * Parse input line into seconds (%d) and a message
+     * (%63[^\n]), consisting of up to 63 characters
+     * separated from the seconds by whitespace.
+     */
+    if (sscanf (line, "%d %63[^\n]",
+                &alarm->seconds, alarm->message) < 2) {
+        fprintf (stderr, "Bad command\n");
+        free (alarm);
+        return;
+    } else {
+        submit_alarm (alarm, stage_start);
+    }
+}
+
+/* Thread function for an input source: parse it line by line, as
+ * stdin is. A named pipe is opened again each time its writer goes
+ * away; a file is done at its end.
+ */
+void * input_thread(void * arg){
+    input_t * input = (input_t *) arg;
+    struct stat info;
+    char line[128];
+    FILE * source;
+    unsigned long lines = 0;
+
+    register_thread(PROF_ROLE_PARSER, input->index);
+    snprintf(parser_name, sizeof(parser_name), "Input %d", input->index);
+
+    do {
+        //Blocks until a named pipe has a writer
+        source = fopen(input->path, "r");
+        if(source == NULL)
+            errno_abort("Open input");
+        while(1){
+            PROF_STAGE(PROF_STAGE_READ);
+            if(fgets(line, sizeof(line), source) == NULL)
+                break;
+            if(strlen(line) <= 1)
+                continue;
+            PROF_STAGE(PROF_STAGE_PARSE);
+            lines++;
+            parse_command(line, trace_now());
+        }
+        fclose(source);
+    } while(stat(input->path, &info) == 0 && S_ISFIFO(info.st_mode));
 
+    PROF_STAGE(PROF_STAGE_IDLE);
+    printf("Input %d: finished %s after %lu lines\n", input->index, input->path, lines);
+    return NULL;
+}
+
+//A line of a stdin chunk: an alarm made ready to submit, or a command
+typedef struct parsed_line {
+    char * line;
+    alarm_t * alarm;
+    char local_str[DATEFORMAT_SIZE];
+} parsed_line_t;
+
+/* Pipeline hook for stdin with -j: parse a chunk of it. Alarm lines
+ * are parsed, stamped with the chunk's read time and rendered here,
+ * on as many parsers as there are. Then, in the chunk's turn, they
+ * are numbered and handed over in the order they were read, and any
+ * other command is carried out between them as it would have been
+ * from the prompt. Alarms due at the same time therefore still fire
+ * in the order they were typed.
+ */
+void parse_chunk(pipeline_chunk_t * chunk){
+    static __thread parsed_line_t * parsed = NULL;
+    static __thread int capacity = 0;
+    parsed_line_t * grown;
+    char * line, * end;
+    alarm_t * alarm;
+    unsigned long long stage_start;
+    int count = 0, i;
+
+    PROF_STAGE(PROF_STAGE_PARSE);
+    stage_start = trace_now();
+    for(line = chunk->data; line < chunk->data + chunk->length; line = end + 1){
+        end = strchr(line, '\n');
+        if(end == NULL)
+            end = chunk->data + chunk->length;
+        *end = '\0';
+        if(*line == '\0')
+            continue;
+
+        if(count == capacity){
+            capacity = capacity ? capacity * 2 : 1024;
+            grown = realloc(parsed, capacity * sizeof(parsed_line_t));
+            if(grown == NULL)
+                errno_abort("Allocate parsed lines");
+            parsed = grown;
+        }
+        parsed[count].line = line;
+        parsed[count].alarm = NULL;
+
+        //Commands all start with a letter, so only these can be alarms
+        if(isdigit((unsigned char)*line) || *line == '-' || *line == '+'){
+            alarm = malloc(sizeof(alarm_t));
+            if(alarm == NULL)
+                errno_abort("Allocate alarm");
+            alarm->origin = 0;
+            alarm->chain_steps = 0;
+            alarm->spread_ms = 0;
+            alarm->action = 0;
+            if(sscanf(line, "%d %63[^\n]", &alarm->seconds, alarm->message) < 2)
+                free(alarm);
+            else {
+                stamp_alarm(alarm, &chunk->read_at, parsed[count].local_str);
+                render_expiry(alarm);
+                parsed[count].alarm = alarm;
+            }
+        }
+        count++;
+    }
+
+    PROF_STAGE(PROF_STAGE_WAIT);
+    pipeline_turn(chunk);
+    PROF_STAGE(PROF_STAGE_PARSE);
+    for(i = 0; i < count; i++){
+        if(parsed[i].alarm == NULL){
+            parse_command(parsed[i].line, trace_now());
+            continue;
+        }
+        parsed[i].alarm->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+        post_alarm(parsed[i].alarm, parsed[i].local_str, stage_start);
     }
+    PROF_STAGE(PROF_STAGE_READ);
+}
+
+//Pipeline hook: each stdin parser is a parser after the -i inputs
+void pipeline_setup(int index){
+    register_thread(PROF_ROLE_PARSER, INPUT_MAX + index);
 }
 
 int main (int argc, char *argv[])
 {
     int status;
     char line[128];
-    alarm_t *alarm;
     pthread_t thread;
-    struct tm main_local_time, * err_check;
-    char main_local_str[DATEFORMAT_SIZE];
+    int option;
+    //Tracing options
+    const char * trace_path = NULL;
+    int trace_sample = 10;
+    unsigned long long stage_start;
+    //Flight recorder dump file, stderr unless -F is given
+    int fr_fd = 2;
+    //Stats socket
+    const char * stats_path = NULL;
+    //Expiry commands allowed to run at once, 0 for no launcher
+    int launcher_limit = 0;
+    //Where stdout spills when the reader falls behind, /tmp unless -S is given
+    const char * spill_path = NULL;
+    //gzip level for stdout, 0 for none
+    int output_level = 0;
+    //File sink instead of stdout: path, rotation size and age, segments kept
+    const char * sink_path = NULL;
+    long long sink_size = 0;
+    int sink_period = 0, sink_segments = 0;
+    //Input sources besides stdin
+    input_t inputs[INPUT_MAX];
+    int i;
+    //Parser threads for stdin, 0 to parse it here line by line
+    int pipeline_parsers = 0;
+
+    while ((option = getopt(argc, argv, "p:t:T:F:s:H:B:L:S:Z:o:R:P:K:i:j:")) != -1) {
+        switch (option) {
+        case 'p':
+            //Sampling profiler, in samples per CPU second per thread
+            if (prof_init(atoi(optarg)) != 0)
+                errno_abort("Start profiler");
+            break;
+        case 't':
+            //Chrome trace output file
+            trace_path = optarg;
+            break;
+        case 'T':
+            //Trace one alarm in every n
+            trace_sample = atoi(optarg);
+            break;
+        case 'F':
+            //Flight recorder dump file
+            fr_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (fr_fd < 0)
+                errno_abort("Open flight recorder file");
+            break;
+        case 's':
+            //Unix socket answering stats queries
+            stats_path = optarg;
+            break;
+        case 'H':
+            //Staging horizon in seconds
+            stage_horizon = atoi(optarg);
+            break;
+        case 'B':
+            //Shard queue backend: list, heap, wheel or adaptive
+            for (queue_backend = 0; queue_backend <= QUEUE_ADAPTIVE; queue_backend++)
+                if (strcmp(optarg, queue_backend_name(queue_backend)) == 0)
+                    break;
+            if (queue_backend > QUEUE_ADAPTIVE)
+                err_abort(EINVAL, "Unknown queue backend");
+            break;
+        case 'L':
+            //Commands run on expiry at once, through the launcher
+            launcher_limit = atoi(optarg);
+            break;
+        case 'S':
+            //Spill file for output the reader has not taken yet
+            spill_path = optarg;
+            break;
+        case 'Z':
+            //Compress stdout, gzip level 1 to 9
+            output_level = atoi(optarg);
+            if (output_level < 1 || output_level > 9)
+                err_abort(EINVAL, "Compression level");
+            break;
+        case 'o':
+            //Write output to rotating segments of this file
+            sink_path = optarg;
+            break;
+        case 'R':
+            //Rotate the file sink every n megabytes
+            sink_size = atoll(optarg) << 20;
+            break;
+        case 'P':
+            //Rotate the file sink every n seconds
+            sink_period = atoi(optarg);
+            break;
+        case 'K':
+            //Keep this many file sink segments, overwriting the oldest
+            sink_segments = atoi(optarg);
+            break;
+        case 'i':
+            //Another input, a file or named pipe with a parser thread of its own
+            if (input_count == INPUT_MAX)
+                err_abort(EINVAL, "Too many inputs");
+            inputs[input_count].index = input_count + 1;
+            inputs[input_count].path = optarg;
+            input_count++;
+            break;
+        case 'j':
+            //Parse stdin in chunks on this many threads
+            pipeline_parsers = atoi(optarg);
+            if (pipeline_parsers < 1 || pipeline_parsers > PIPELINE_MAX)
+                err_abort(EINVAL, "Pipeline parsers");
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p hz] [-t trace.json [-T sample]] [-F dumpfile] [-s socket] [-H horizon] [-B backend] [-L commands] [-S spillfile] [-Z level] [-o file [-R mb] [-P secs] [-K segments]] [-i input]... [-j parsers]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
+    //Main (unless it has other inputs or a pipeline) and the alarm thread busy-wait; the display threads sleep
+    cgroup_init (input_count == 0 && pipeline_parsers == 0 ? 2 : 1);
+
+    //Fork the launcher helper while this is the only thread
+    if (launcher_limit > 0) {
+        status = launcher_start(launcher_limit);
+        if (status != 0)
+            err_abort (status, "Start launcher");
+    }
+    //Before any thread can print
+    if (sink_path != NULL) {
+        status = output_sink(sink_path, sink_size, sink_period, sink_segments);
+        if (status != 0)
+            err_abort (status, "Open output file");
+    }
+    status = output_init(spill_path, output_level);
+    if (status != 0)
+        err_abort (status, "Start output");
+    if (trace_path != NULL && trace_init(trace_path, trace_sample) != 0)
+        err_abort(EINVAL, "Start trace");
+    if (fr_init(fr_fd) != 0)
+        errno_abort("Start flight recorder");
+
+    intake_init(&intake);
+    intake_init(&chain_intake);
+    for (i = 0; i < TRANSIT_BUCKETS; i++)
+        pthread_mutex_init (&transit[i].lock, NULL);
+    register_thread(PROF_ROLE_PARSER, 0);
+    await_init(watch_alarm);
+    status = batch_init(shard_batch, BATCH_SIZE);
+    if (status != 0)
+        err_abort (status, "Start batching");
+    status = metrics_start();
+    if (status != 0)
+        err_abort (status, "Start metrics");
+    if (stats_path != NULL) {
+        status = ctl_start(stats_path, socket_submit);
+        if (status != 0)
+            err_abort (status, "Open stats socket");
+    }
 
     //Create the alarm thread;
     status = pthread_create (
@@ -389,7 +1547,30 @@ int main (int argc, char *argv[])
 
     if (status != 0)
         err_abort (status, "Create alarm thread");
+    //Batches and cancels go straight to the shards, so they have to exist
+    while (!__atomic_load_n(&shards_ready, __ATOMIC_ACQUIRE));
 
+    for (i = 0; i < input_count; i++) {
+        status = pthread_create (&inputs[i].thread, NULL, input_thread, &inputs[i]);
+        if (status != 0)
+            err_abort (status, "Create input thread");
+    }
+
+    //Pipelined stdin: no prompt, and no waiting for each alarm to be received
+    if (pipeline_parsers > 0) {
+        status = pipeline_start (0, pipeline_parsers, parse_chunk, pipeline_setup);
+        if (status != 0)
+            err_abort (status, "Start pipeline");
+        PROF_STAGE(PROF_STAGE_IDLE);
+        pipeline_wait ();
+        for (i = 0; i < input_count; i++)
+            pthread_join (inputs[i].thread, NULL);
+        //As stdin alone would have, see every alarm received
+        PROF_STAGE(PROF_STAGE_WAIT);
+        while (alarm_flag != 0)
+            cgroup_relax ();
+        exit (0);
+    }
 
     /* Main Event loop
      * Wait for stdin, parse if correct, then allocate to an alarm
@@ -399,63 +1580,24 @@ int main (int argc, char *argv[])
     while (1) {
 
 
-        while(alarm_flag != 0);
+        //Alone, stdin waits for each alarm to be received before prompting again
+        PROF_STAGE(PROF_STAGE_WAIT);
+        while(input_count == 0 && alarm_flag != 0)
+            cgroup_relax();
 
 
         printf ("alarm> ");
-        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
+        PROF_STAGE(PROF_STAGE_READ);
+        if (fgets (line, sizeof (line), stdin) == NULL) {
+            //The other inputs keep the program going until they end too
+            for (i = 0; i < input_count; i++)
+                pthread_join (inputs[i].thread, NULL);
+            exit (0);
+        }
         if (strlen (line) <= 1) continue;
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));
-        if (alarm == NULL)
-            errno_abort ("Allocate alarm");
-
-        /*
-         * Parse input line into seconds (%d) and a message
-         * (%64[^\n]), consisting of up to 64 characters
-         * separated from the seconds by whitespace.
-         */
-        if (sscanf (line, "%d %64[^\n]",
-                    &alarm->seconds, alarm->message) < 2) {
-            fprintf (stderr, "Bad command\n");
-            free (alarm);
-            continue;
-        } else {
-            //Lock the thread
-            status = pthread_mutex_lock (&alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Lock mutex");
-
-
-            //Allocate the time
-            clock_gettime(CLOCK_REALTIME, &(alarm->time));
-            //Set alarm time
-            alarm->time.tv_sec += alarm->seconds;
-            //get the local time string
-            err_check = localtime_r(&(alarm->time.tv_sec),&main_local_time);
-            if(err_check == NULL)
-                fprintf(stderr, "Error Acquiring local time\n");
-
-            strftime(main_local_str,DATEFORMAT_SIZE,date_format_string,&main_local_time);
-
-            flockfile(stdout);
-            //Output message to console
-            printf("Main Thread Received Alarm Request at %s: %d seconds with message: %s\n",
-                   main_local_str, alarm->seconds, alarm->message);
-            fflush(stdout);
-            funlockfile(stdout);
+        PROF_STAGE(PROF_STAGE_PARSE);
+        stage_start = trace_now();
 
-            //Set alarm list to the current alarm. NULL the next in sequence
-            alarm_list = alarm;
-            alarm_list->link = NULL;
-            //Set flag for alarm thread to wait on the mutex
-            alarm_flag = 1;
-
-            //Unlock the alarm thread
-            status = pthread_mutex_unlock (&alarm_mutex);
-
-
-            if (status != 0)
-                err_abort (status, "Unlock mutex");
-        }
+        parse_command (line, stage_start);
     }
 }
@@ -0,0 +1,59 @@
+#ifndef __alarm_h
+#define __alarm_h
+
+#include <time.h>
+
+#define DATEFORMAT_SIZE 50
+//Room for an expiry record, see expiry below
+#define EXPIRY_SIZE 160
+//Widest spread window an alarm can ask for
+#define SPREAD_MAX_MS 3600000
+
+//Where an alarm currently lives
+#define ALARM_UNQUEUED 0
+#define ALARM_QUEUED 1      /* in a shard's ordered list, heap or wheel */
+#define ALARM_STAGED 2      /* in a shard's staging area */
+#define ALARM_TRANSIT 3     /* on its way to a shard */
+#define ALARM_CANCELLED 4   /* cancelled on its way, freed when it gets there */
+
+/*
+ * The "alarm" structure now contains the time_t (time since the
+ * Epoch, in seconds) for each alarm, so that they can be
+ * sorted. Storing the requested number of seconds would not be
+ * enough, since the "alarm thread" cannot tell how long it has
+ * been on the list.
+ *
+ * pprev points at whichever link field points at this alarm, so
+ * an alarm can be unlinked from any list without a walk.
+ *
+ * key is the compact deadline the shard queue sorts on, kept next
+ * to link so a walk down the list only reads the first few bytes
+ * of each alarm.
+ *
+ * expiry is the record printed (or sent to the alarm's connection)
+ * when it fires, rendered when it is submitted, so firing it is a
+ * copy rather than a localtime, a strftime and a printf.
+ */
+typedef struct alarm_tag {
+    struct alarm_tag    *link;
+    unsigned int        key;        /* see queue.h */
+    int                 state;
+    int                 slot;       /* position in a heap backed queue */
+    struct alarm_tag    **pprev;
+    struct alarm_tag    *id_link;   /* shard id index chain */
+    unsigned long       id;
+    int                 seconds;
+    int                 chain_seconds;  /* follow-up interval */
+    int                 chain_steps;    /* follow-ups still to run */
+    int                 action;         /* run message as a command when it fires, see launcher.h */
+    struct timespec     time;   /* seconds from EPOCH */
+    struct waiter       *waiters;   /* see await.h */
+    unsigned long       origin;     /* submitting connection, 0 for stdin, see ctl.h */
+    int                 spread_ms;  /* may fire this much late, to smooth bursts, see queue.h */
+    char                message[64];
+    char                time_retrieved[DATEFORMAT_SIZE];
+    int                 expiry_length;
+    char                expiry[EXPIRY_SIZE];
+} alarm_t;
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * await.c
+ *
+ * Per-alarm waiter lists, see await.h. The lists themselves live in
+ * the alarms, under the lock of whichever shard holds the alarm, so
+ * the only thing here is the hook for finding an alarm by id and the
+ * sleeping and waking.
+ */
+#define _GNU_SOURCE
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "errors.h"
+#include "await.h"
+
+static await_watch_t await_hook = NULL;
+
+static const char * await_outcome_names[] = { "pending", "fired", "cancelled", "unknown" };
+
+void await_init(await_watch_t watch){
+    await_hook = watch;
+}
+
+const char * await_outcome_name(int outcome){
+    if(outcome < AWAIT_PENDING || outcome > AWAIT_UNKNOWN)
+        return "unknown";
+    return await_outcome_names[outcome];
+}
+
+/* Attach a waiter set up by the caller to alarm id. Returns
+ * AWAIT_PENDING if it will be woken, AWAIT_UNKNOWN if not.
+ */
+int await_watch(unsigned long id, waiter_t * waiter){
+    waiter->id = id;
+    waiter->state = AWAIT_PENDING;
+    if(await_hook == NULL || await_hook(id, waiter) != 0){
+        waiter->state = AWAIT_UNKNOWN;
+        return AWAIT_UNKNOWN;
+    }
+    return AWAIT_PENDING;
+}
+
+//Block until alarm id fires or is cancelled, and say which.
+int await_alarm(unsigned long id){
+    waiter_t waiter;
+    int state;
+
+    waiter.notify = NULL;
+    if(await_watch(id, &waiter) == AWAIT_UNKNOWN)
+        return AWAIT_UNKNOWN;
+
+    while((state = __atomic_load_n(&waiter.state, __ATOMIC_ACQUIRE)) == AWAIT_PENDING)
+        syscall(SYS_futex, &waiter.state, FUTEX_WAIT_PRIVATE, AWAIT_PENDING, NULL, NULL, 0);
+    return state;
+}
+
+/* Wake every waiter on list with outcome. Called by the alarm's
+ * owner once the alarm is off its queue, so no more can be added.
+ */
+void await_wake(struct waiter ** list, int outcome){
+    waiter_t * waiter, * next;
+
+    for(waiter = *list, *list = NULL; waiter != NULL; waiter = next){
+        //The waiter may be gone as soon as it sees its state
+        next = waiter->next;
+        if(waiter->notify != NULL){
+            waiter->state = outcome;
+            waiter->notify(waiter);
+            continue;
+        }
+        __atomic_store_n(&waiter->state, outcome, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &waiter->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef __await_h
+#define __await_h
+
+/*
+ * await.h
+ *
+ * Waiting for one alarm. A waiter is pushed onto its alarm's waiter
+ * list while the alarm is still queued, and the alarm's owner wakes
+ * every waiter on the list once it has taken the alarm off its
+ * queue, fired or cancelled. Nobody polls: a thread in await_alarm
+ * sleeps on a futex in its own waiter, and a waiter with a notify
+ * callback (the stats socket's) is handed to that callback instead.
+ * Either way each waiter is woken exactly once.
+ */
+
+//Outcomes
+#define AWAIT_PENDING 0
+#define AWAIT_FIRED 1
+#define AWAIT_CANCELLED 2
+#define AWAIT_UNKNOWN 3     /* no such alarm pending */
+
+typedef struct waiter {
+    struct waiter * next;
+    unsigned long id;
+    int state;                          /* futex word, AWAIT_PENDING until woken */
+    void (*notify)(struct waiter *);    /* NULL for a thread in await_alarm */
+} waiter_t;
+
+/* Attaches a waiter to the pending alarm with the given id, so that
+ * it can't fire in between. Returns 0, or -1 if it isn't pending.
+ */
+typedef int (*await_watch_t)(unsigned long id, waiter_t * waiter);
+
+void await_init(await_watch_t watch);
+int await_watch(unsigned long id, waiter_t * waiter);
+int await_alarm(unsigned long id);
+void await_wake(struct waiter ** list, int outcome);
+const char * await_outcome_name(int outcome);
+
+#endif
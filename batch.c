@@ -0,0 +1,180 @@
+/*
+ * batch.c
+ *
+ * Submission batching, see batch.h. Every submitting thread gets a
+ * batch_t of its own the first time it submits, linked on a list the
+ * batch thread walks to flush buffers that have waited too long. The
+ * buffer's lock is only ever contended by that walk. A thread's
+ * buffer is flushed when the thread exits and is then free for the
+ * next new thread to take over; buffers are never freed, as the
+ * walk may be looking at them.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include "errors.h"
+#include "batch.h"
+#include "metrics.h"
+
+typedef struct batch {
+    struct batch * next;
+    pthread_mutex_t lock;
+    int owned;                          /* taken by a live thread */
+    int count;
+    unsigned long long oldest_ns;       /* when pending[0] was submitted */
+    alarm_t * pending[BATCH_MAX];
+} batch_t;
+
+static batch_flush_t batch_hook;
+static int batch_started;
+static int batch_size = BATCH_SIZE;
+static batch_t * batch_list;
+static pthread_key_t batch_key;
+static __thread batch_t * batch_self;
+
+//Flushes and alarms flushed, by reason
+static unsigned long batch_flushes[BATCH_REASONS];
+static unsigned long batch_alarms[BATCH_REASONS];
+
+static const char * batch_reason_names[BATCH_REASONS] = { "full", "near", "timer", "explicit" };
+
+static unsigned long long batch_now_ns(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//Hand the buffer to the flush hook. Called with the buffer's lock held.
+static void batch_drain(batch_t * batch, int reason){
+    if(batch->count == 0)
+        return;
+    batch_hook(batch->pending, batch->count);
+    __atomic_add_fetch(&batch_flushes[reason], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&batch_alarms[reason], batch->count, __ATOMIC_RELAXED);
+    batch->count = 0;
+}
+
+//Thread exit: flush what is left and give the buffer up.
+static void batch_release(void * arg){
+    batch_t * batch = arg;
+
+    pthread_mutex_lock(&batch->lock);
+    batch_drain(batch, BATCH_EXPLICIT);
+    pthread_mutex_unlock(&batch->lock);
+    __atomic_store_n(&batch->owned, 0, __ATOMIC_RELEASE);
+}
+
+//The calling thread's buffer: one given up by an exited thread, or a new one.
+static batch_t * batch_get(void){
+    batch_t * batch;
+    int free = 0;
+
+    if(batch_self != NULL)
+        return batch_self;
+
+    for(batch = __atomic_load_n(&batch_list, __ATOMIC_ACQUIRE); batch != NULL; batch = batch->next){
+        free = 0;
+        if(__atomic_compare_exchange_n(&batch->owned, &free, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+    if(batch == NULL){
+        batch = calloc(1, sizeof(batch_t));
+        if(batch == NULL)
+            errno_abort("Allocate submission batch");
+        pthread_mutex_init(&batch->lock, NULL);
+        batch->owned = 1;
+        batch->next = __atomic_load_n(&batch_list, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&batch_list, &batch->next, batch, 0,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(batch_key, batch);
+    batch_self = batch;
+    return batch;
+}
+
+//Flush buffers that have been waiting for BATCH_INTERVAL_MS.
+static void * batch_thread(void * arg){
+    struct timespec interval = { 0, BATCH_INTERVAL_MS * 1000000L };
+    unsigned long long now;
+    batch_t * batch;
+
+    metrics_register_thread("batch");
+    while(1){
+        nanosleep(&interval, NULL);
+        now = batch_now_ns();
+        for(batch = __atomic_load_n(&batch_list, __ATOMIC_ACQUIRE); batch != NULL; batch = batch->next){
+            if(__atomic_load_n(&batch->count, __ATOMIC_RELAXED) == 0)
+                continue;
+            pthread_mutex_lock(&batch->lock);
+            if(batch->count > 0 && now - batch->oldest_ns >= BATCH_INTERVAL_MS * 1000000ULL)
+                batch_drain(batch, BATCH_TIMER);
+            pthread_mutex_unlock(&batch->lock);
+        }
+    }
+    return NULL;
+}
+
+/* Send batches to flush, size alarms at most (BATCH_SIZE if 0), and
+ * start the batch thread. Called again, only changes the hook and
+ * the size; buffers should be empty then.
+ */
+int batch_init(batch_flush_t flush, int size){
+    pthread_t thread;
+    int status;
+
+    batch_hook = flush;
+    batch_size = size <= 0 ? BATCH_SIZE : size < BATCH_MAX ? size : BATCH_MAX;
+    if(batch_started++)
+        return 0;
+    status = pthread_key_create(&batch_key, batch_release);
+    if(status != 0)
+        return status;
+    status = pthread_create(&thread, NULL, batch_thread, NULL);
+    if(status != 0)
+        return status;
+    return pthread_detach(thread);
+}
+
+void batch_submit(alarm_t * alarm){
+    batch_t * batch = batch_get();
+    struct timespec now;
+    long long lead_usec;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    lead_usec = (alarm->time.tv_sec - now.tv_sec) * 1000000LL
+                + (alarm->time.tv_nsec - now.tv_nsec) / 1000;
+
+    pthread_mutex_lock(&batch->lock);
+    if(batch->count == 0)
+        batch->oldest_ns = batch_now_ns();
+    batch->pending[batch->count++] = alarm;
+    if(batch->count >= batch_size)
+        batch_drain(batch, BATCH_FULL);
+    else if(lead_usec < BATCH_NEAR_USEC)
+        batch_drain(batch, BATCH_NEAR);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+//Flush the calling thread's buffer now.
+void batch_flush(void){
+    batch_t * batch = batch_get();
+
+    pthread_mutex_lock(&batch->lock);
+    batch_drain(batch, BATCH_EXPLICIT);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+void batch_stats(FILE * out){
+    unsigned long flushes, alarms;
+    int reason;
+
+    fprintf(out, "Batches (size %d):", batch_size);
+    for(reason = 0; reason < BATCH_REASONS; reason++){
+        flushes = __atomic_load_n(&batch_flushes[reason], __ATOMIC_RELAXED);
+        alarms = __atomic_load_n(&batch_alarms[reason], __ATOMIC_RELAXED);
+        fprintf(out, " %s %lu (%.1f alarms each)", batch_reason_names[reason],
+                flushes, flushes > 0 ? (double)alarms / flushes : 0.0);
+    }
+    fprintf(out, "\n");
+}
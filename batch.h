@@ -0,0 +1,47 @@
+#ifndef __batch_h
+#define __batch_h
+
+#include <stdio.h>
+#include "alarm.h"
+
+/*
+ * batch.h
+ *
+ * Thread-local submission batching for threads that schedule alarms
+ * in process. batch_submit only appends to the calling thread's own
+ * buffer; the buffer is handed to the flush hook, which puts the
+ * whole batch on the shard queues with one lock per shard, when it
+ * is full, when an alarm in it is due within BATCH_NEAR_USEC, when
+ * it has waited BATCH_INTERVAL_MS (the batch thread checks), or on
+ * batch_flush. So hundreds of submitting threads take the shard
+ * locks a batch at a time instead of an alarm at a time.
+ *
+ * Alarms must have their id and absolute time set before they are
+ * submitted. Until its batch is flushed an alarm is not on any queue:
+ * it can't be cancelled or awaited yet.
+ */
+
+//Largest batch, and the default
+#define BATCH_MAX 256
+#define BATCH_SIZE 32
+//Longest a submission waits in a buffer
+#define BATCH_INTERVAL_MS 10
+//Alarms due sooner than this are flushed at once
+#define BATCH_NEAR_USEC 50000
+
+//Why a batch was flushed
+#define BATCH_FULL 0
+#define BATCH_NEAR 1
+#define BATCH_TIMER 2
+#define BATCH_EXPLICIT 3
+#define BATCH_REASONS 4
+
+//Puts count alarms on their queues
+typedef void (*batch_flush_t)(alarm_t ** alarms, int count);
+
+int batch_init(batch_flush_t flush, int size);
+void batch_submit(alarm_t * alarm);
+void batch_flush(void);
+void batch_stats(FILE * out);
+
+#endif
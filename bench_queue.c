@@ -0,0 +1,919 @@
+/*
+ * bench_queue.c
+ *
+ * Benchmarks for the shard queue. Runs against simulated time so
+ * results don't depend on the wall clock.
+ *
+ *   bench_queue [workload] [alarms] [cancel percent]
+ *
+ * Workloads:
+ *   cancel     timeouts 30 to 330 seconds out, most of them cancelled
+ *              before they are due, at several staging horizons
+ *   range      window counts over an hour of alarms, through the B+tree
+ *              index against scanning every pending alarm, and
+ *              cancelling whole windows
+ *   backend    list, heap and wheel backends on a few workload shapes,
+ *              and the backend adaptive mode settles on for each
+ *   kernel     a heap queue against one timer_create timer or one
+ *              timerfd per alarm, in real time, at growing sizes up
+ *              to the kernel's limits
+ *   fanin      64 threads submitting at once to two locked shard
+ *              queues, an alarm per lock against thread-local batches
+ *              of several sizes, in real time
+ *   render     the display threads' fire path: formatting the expiry
+ *              record when the alarm fires against writing the one
+ *              rendered when it was submitted
+ *   merge      batches of 10 to 100000 alarms arriving at a list and
+ *              a heap queue already holding alarms, inserted one at a
+ *              time against radix sorted and merged in one pass
+ *   spread     alarms all due in the same second, with and without a
+ *              spread window: fires per second, and how late each
+ *              fired against the window it allowed
+ */
+#include <pthread.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include "errors.h"
+#include "alarm.h"
+#include "queue.h"
+#include "ktimer.h"
+#include "batch.h"
+
+#define BENCH_BASE_TIME 1000000000L
+
+static double bench_elapsed(struct timespec * start){
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+static double bench_elapsed_cpu(struct timespec * start){
+    struct timespec end;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+//Shuffle ids so cancels hit the queue in no particular order
+static void bench_shuffle(unsigned long * ids, int count, unsigned int * seed){
+    unsigned long swap;
+    int i, j;
+
+    for(i = count - 1; i > 0; i--){
+        j = rand_r(seed) % (i + 1);
+        swap = ids[i];
+        ids[i] = ids[j];
+        ids[j] = swap;
+    }
+}
+
+/* Insert every alarm, cancel cancel_percent of them, then let time
+ * run until the rest have fired.
+ */
+static void bench_cancel_run(int horizon, int count, int cancel_percent){
+    queue_t * queue;
+    alarm_t * alarms;
+    unsigned long * ids;
+    unsigned int seed = 42;
+    struct timespec start;
+    double insert_ns, cancel_ns, drain_ns;
+    time_t now, last = BENCH_BASE_TIME;
+    int i, cancels, fired = 0;
+
+    queue = malloc(sizeof(queue_t));
+    alarms = calloc(count, sizeof(alarm_t));
+    ids = malloc(count * sizeof(unsigned long));
+    if(queue == NULL || alarms == NULL || ids == NULL)
+        errno_abort("Allocate benchmark");
+
+    queue_init(queue, horizon);
+    for(i = 0; i < count; i++){
+        alarms[i].id = i + 1;
+        alarms[i].time.tv_sec = BENCH_BASE_TIME + 30 + rand_r(&seed) % 300;
+        if(alarms[i].time.tv_sec > last)
+            last = alarms[i].time.tv_sec;
+        ids[i] = i + 1;
+    }
+    bench_shuffle(ids, count, &seed);
+    cancels = (long)count * cancel_percent / 100;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < count; i++)
+        queue_insert(queue, &alarms[i], BENCH_BASE_TIME);
+    insert_ns = bench_elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < cancels; i++)
+        if(queue_cancel(queue, ids[i]) == NULL)
+            err_abort(ENOENT, "Cancel missed");
+    cancel_ns = bench_elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(now = BENCH_BASE_TIME; now <= last; now++){
+        queue_promote(queue, now);
+        while(queue_head(queue) != NULL && queue_head(queue)->time.tv_sec <= now){
+            queue_pop(queue);
+            fired++;
+        }
+    }
+    drain_ns = bench_elapsed(&start);
+
+    if(fired != count - cancels)
+        err_abort(EINVAL, "Wrong number of alarms fired");
+
+    printf("%7d %7d %8d %12.1f %12.1f %12.1f %10.2f\n",
+           horizon, count, cancels, insert_ns / count,
+           cancels ? cancel_ns / cancels : 0.0,
+           fired ? drain_ns / fired : 0.0,
+           (insert_ns + cancel_ns + drain_ns) / 1e6);
+
+    queue_destroy(queue);
+    free(ids);
+    free(alarms);
+    free(queue);
+}
+
+static void bench_cancel(int count, int cancel_percent){
+    int horizons[] = { 0, 5, 30 };
+    int i;
+
+    printf("cancel-heavy timeouts (horizon 0 = no staging)\n");
+    printf("horizon  alarms  cancels  insert ns/op cancel ns/op  drain ns/op   total ms\n");
+    for(i = 0; i < (int)(sizeof(horizons) / sizeof(horizons[0])); i++)
+        bench_cancel_run(horizons[i], count, cancel_percent);
+}
+
+//Count pending alarms due in [from, to) the way the bare lists would have to.
+//The queue is on the list backend.
+static unsigned long bench_scan_count(queue_t * queue, time_t from, time_t to){
+    alarm_t * alarm;
+    unsigned long count = 0;
+    time_t when;
+    int bucket;
+
+    for(alarm = queue->list; alarm != NULL; alarm = alarm->link){
+        when = alarm->time.tv_sec + queue->epoch.tv_sec;
+        count += when >= from && when < to;
+    }
+    for(bucket = 0; bucket < QUEUE_STAGE_BUCKETS; bucket++)
+        for(alarm = queue->staged[bucket]; alarm != NULL; alarm = alarm->link){
+            when = alarm->time.tv_sec + queue->epoch.tv_sec;
+            count += when >= from && when < to;
+        }
+    return count;
+}
+
+static void bench_range(int count){
+    queue_t * queue;
+    alarm_t * alarms, * cancelled;
+    unsigned int seed = 7;
+    struct timespec start, from, to;
+    double index_ns, scan_ns, cancel_ns;
+    unsigned long indexed = 0, scanned = 0;
+    int i, queries = 1000, windows = 0, removed = 0;
+
+    queue = malloc(sizeof(queue_t));
+    alarms = calloc(count, sizeof(alarm_t));
+    if(queue == NULL || alarms == NULL)
+        errno_abort("Allocate benchmark");
+
+    queue_init(queue, 10);
+    for(i = 0; i < count; i++){
+        alarms[i].id = i + 1;
+        alarms[i].time.tv_sec = BENCH_BASE_TIME + rand_r(&seed) % 3600;
+        queue_insert(queue, &alarms[i], BENCH_BASE_TIME);
+    }
+
+    from.tv_nsec = to.tv_nsec = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < queries; i++){
+        from.tv_sec = BENCH_BASE_TIME + (i * 7919) % 3300;
+        to.tv_sec = from.tv_sec + 300;
+        indexed += queue_range_count(queue, &from, &to);
+    }
+    index_ns = bench_elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < queries; i++){
+        from.tv_sec = BENCH_BASE_TIME + (i * 7919) % 3300;
+        scanned += bench_scan_count(queue, from.tv_sec, from.tv_sec + 300);
+    }
+    scan_ns = bench_elapsed(&start);
+
+    if(indexed != scanned)
+        err_abort(EINVAL, "Index and scan disagree");
+
+    //Cancel ten one minute windows
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < 10; i++, windows++){
+        from.tv_sec = BENCH_BASE_TIME + i * 300;
+        to.tv_sec = from.tv_sec + 60;
+        for(cancelled = queue_range_cancel(queue, &from, &to); cancelled != NULL; cancelled = cancelled->link)
+            removed++;
+    }
+    cancel_ns = bench_elapsed(&start);
+
+    printf("range queries over %d alarms spread across an hour, 5 minute windows\n", count);
+    printf("index count %10.1f ns/query\n", index_ns / queries);
+    printf("list scan   %10.1f ns/query\n", scan_ns / queries);
+    printf("range cancel of %d windows: %d alarms, %.1f ns/alarm\n",
+           windows, removed, removed ? cancel_ns / removed : 0.0);
+
+    queue_destroy(queue);
+    free(alarms);
+    free(queue);
+}
+
+typedef struct bench_shape {
+    const char * name;
+    int alarms;                 /* 0: as many as asked for */
+    long long spread;           /* usec of deadlines, starting a second out */
+    int cancel_percent;
+} bench_shape_t;
+
+/* Insert, cancel and drain a workload shape on one backend, with
+ * staging off so every alarm goes through the backend.
+ */
+static void bench_backend_run(bench_shape_t * shape, int backend, int count){
+    queue_t * queue;
+    alarm_t * alarms, * head;
+    unsigned long * ids;
+    unsigned int seed = 11;
+    struct timespec start;
+    double insert_ns, cancel_ns, drain_ns;
+    char reason[128];
+    long long usec;
+    time_t now, last = BENCH_BASE_TIME;
+    int i, cancels, fired = 0;
+
+    if(shape->alarms > 0)
+        count = shape->alarms;
+    queue = malloc(sizeof(queue_t));
+    alarms = calloc(count, sizeof(alarm_t));
+    ids = malloc(count * sizeof(unsigned long));
+    if(queue == NULL || alarms == NULL || ids == NULL)
+        errno_abort("Allocate benchmark");
+
+    queue_init(queue, 0);
+    queue_set_backend(queue, backend);
+    for(i = 0; i < count; i++){
+        usec = 1000000LL + ((long long)rand_r(&seed) * RAND_MAX + rand_r(&seed)) % shape->spread;
+        alarms[i].id = i + 1;
+        alarms[i].time.tv_sec = BENCH_BASE_TIME + usec / 1000000;
+        alarms[i].time.tv_nsec = usec % 1000000 * 1000;
+        if(alarms[i].time.tv_sec > last)
+            last = alarms[i].time.tv_sec;
+        ids[i] = i + 1;
+    }
+    bench_shuffle(ids, count, &seed);
+    cancels = (long)count * shape->cancel_percent / 100;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < count; i++)
+        queue_insert(queue, &alarms[i], BENCH_BASE_TIME);
+    insert_ns = bench_elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < cancels; i++)
+        if(queue_cancel(queue, ids[i]) == NULL)
+            err_abort(ENOENT, "Cancel missed");
+    cancel_ns = bench_elapsed(&start);
+
+    //Two windows of this workload, as a display thread would see them
+    queue_adapt(queue, BENCH_BASE_TIME, reason, sizeof(reason));
+    for(i = 1; i <= 2; i++){
+        queue->inserts = count;
+        queue->cancels = cancels;
+        queue_adapt(queue, BENCH_BASE_TIME + i * QUEUE_ADAPT_WINDOW, reason, sizeof(reason));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(now = BENCH_BASE_TIME; now <= last; now++){
+        queue_promote(queue, now);
+        while((head = queue_head(queue)) != NULL && head->time.tv_sec <= now){
+            queue_pop(queue);
+            fired++;
+        }
+    }
+    drain_ns = bench_elapsed(&start);
+
+    if(fired != count - cancels)
+        err_abort(EINVAL, "Wrong number of alarms fired");
+
+    printf("%-9s %-9s %7d %12.1f %12.1f %12.1f %10.2f",
+           shape->name, queue_backend_name(backend), count, insert_ns / count,
+           cancels ? cancel_ns / cancels : 0.0,
+           fired ? drain_ns / fired : 0.0,
+           (insert_ns + cancel_ns + drain_ns) / 1e6);
+    if(backend == QUEUE_ADAPTIVE)
+        printf("  -> %s", queue_backend_name(queue->backend));
+    printf("\n");
+
+    queue_destroy(queue);
+    free(ids);
+    free(alarms);
+    free(queue);
+}
+
+static void bench_backend(int count, int cancel_percent){
+    bench_shape_t shapes[] = {
+        { "near", 32, 10000000LL, 0 },
+        { "timeouts", 0, 60000000LL, cancel_percent },
+        { "burst", 0, 500000LL, 0 },
+        { "spread", 0, 3600000000LL, 0 },
+    };
+    int i, backend;
+
+    printf("backends, no staging (adaptive inserts and cancels on the list, then drains on its choice)\n");
+    printf("shape     backend    alarms insert ns/op cancel ns/op  drain ns/op   total ms\n");
+    for(i = 0; i < (int)(sizeof(shapes) / sizeof(shapes[0])); i++)
+        for(backend = 0; backend <= QUEUE_ADAPTIVE; backend++)
+            bench_backend_run(&shapes[i], backend, count);
+}
+
+//Bytes of heap this process has allocated and not freed
+static long bench_heap_bytes(void){
+    return mallinfo2().uordblks;
+}
+
+//Bytes of kernel slab in use, system wide
+static long bench_slab(void){
+    FILE * meminfo = fopen("/proc/meminfo", "r");
+    char line[128];
+    long kb = 0;
+
+    if(meminfo == NULL)
+        return 0;
+    while(fgets(line, sizeof(line), meminfo) != NULL)
+        if(sscanf(line, "Slab: %ld kB", &kb) == 1)
+            break;
+    fclose(meminfo);
+    return kb * 1024;
+}
+
+static int bench_compare_long(const void * a, const void * b){
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Arm count alarms due between half a second and a second from now,
+ * cancel cancel_percent of them, and collect the rest as they fire.
+ * kind is a KTIMER_ backend, or -1 for a heap queue slept on with
+ * clock_nanosleep. Returns 0 if the kernel ran out of timers.
+ */
+static int bench_kernel_run(int kind, int count, int cancel_percent){
+    queue_t * queue = NULL;
+    ktimer_t kt;
+    ktimer_entry_t ** entries;
+    alarm_t * alarms, * fired[64], * head;
+    unsigned long * ids;
+    long * late;
+    unsigned int seed = 3;
+    struct timespec start, now, cpu;
+    double arm_ns, cancel_ns, fire_ns;
+    long heap, slab, usec;
+    int i, armed, cancels = 0, found, count_fired = 0, status, limit = 0;
+
+    alarms = calloc(count, sizeof(alarm_t));
+    entries = calloc(count, sizeof(ktimer_entry_t *));
+    ids = malloc(count * sizeof(unsigned long));
+    late = malloc(count * sizeof(long));
+    if(alarms == NULL || entries == NULL || ids == NULL || late == NULL)
+        errno_abort("Allocate benchmark");
+
+    if(kind < 0){
+        queue = malloc(sizeof(queue_t));
+        if(queue == NULL)
+            errno_abort("Allocate benchmark");
+        queue_init(queue, 0);
+        queue_set_backend(queue, QUEUE_HEAP);
+    } else {
+        status = ktimer_init(&kt, kind);
+        if(status != 0)
+            err_abort(status, "Start kernel timers");
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for(i = 0; i < count; i++){
+        usec = 500000 + rand_r(&seed) % 500000;
+        alarms[i].id = i + 1;
+        alarms[i].time.tv_sec = now.tv_sec + (now.tv_nsec / 1000 + usec) / 1000000;
+        alarms[i].time.tv_nsec = (now.tv_nsec / 1000 + usec) % 1000000 * 1000;
+    }
+
+    heap = bench_heap_bytes();
+    slab = bench_slab();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(armed = 0; armed < count; armed++){
+        if(queue != NULL)
+            queue_insert(queue, &alarms[armed], now.tv_sec);
+        else if((entries[armed] = ktimer_arm(&kt, &alarms[armed])) == NULL){
+            limit = errno;
+            break;
+        }
+    }
+    arm_ns = bench_elapsed(&start);
+    heap = bench_heap_bytes() - heap;
+    slab = bench_slab() - slab;
+
+    for(i = 0; i < armed; i++)
+        ids[i] = i + 1;
+    bench_shuffle(ids, armed, &seed);
+    cancels = (long)armed * cancel_percent / 100;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < cancels; i++){
+        if(queue != NULL)
+            queue_cancel(queue, ids[i]);
+        else
+            ktimer_cancel(&kt, entries[ids[i] - 1]);
+    }
+    cancel_ns = bench_elapsed(&start);
+
+    //CPU, not wall time: most of the wait is for the deadlines
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    while(count_fired < armed - cancels){
+        if(queue != NULL){
+            head = queue_head(queue);
+            clock_gettime(CLOCK_REALTIME, &now);
+            if(head->time.tv_sec > now.tv_sec
+               || (head->time.tv_sec == now.tv_sec && head->time.tv_nsec > now.tv_nsec))
+                clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &head->time, NULL);
+            found = 0;
+            clock_gettime(CLOCK_REALTIME, &now);
+            while(found < 64 && (head = queue_head(queue)) != NULL
+                  && (head->time.tv_sec < now.tv_sec
+                      || (head->time.tv_sec == now.tv_sec && head->time.tv_nsec <= now.tv_nsec)))
+                fired[found++] = queue_pop(queue);
+        } else
+            found = ktimer_wait(&kt, fired, 64, 5000);
+        if(found == 0)
+            err_abort(ETIMEDOUT, "Timers did not fire");
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        for(i = 0; i < found; i++)
+            late[count_fired++] = (now.tv_sec - fired[i]->time.tv_sec) * 1000000L
+                                  + (now.tv_nsec - fired[i]->time.tv_nsec) / 1000;
+    }
+    fire_ns = bench_elapsed_cpu(&cpu);
+    qsort(late, count_fired, sizeof(long), bench_compare_long);
+
+    printf("%-13s %7d %10.1f %10.1f %10.1f %8ld %8ld %8ld %8ld ",
+           queue != NULL ? "heap queue" : ktimer_name(kind), armed,
+           armed ? arm_ns / armed : 0.0,
+           cancels ? cancel_ns / cancels : 0.0,
+           count_fired ? fire_ns / count_fired : 0.0,
+           count_fired ? late[count_fired / 2] : 0,
+           count_fired ? late[(long)count_fired * 99 / 100] : 0,
+           count_fired ? late[count_fired - 1] : 0,
+           armed ? heap / armed : 0);
+    //Slab is shared with the rest of the system, so only a rough guide
+    if(armed > 0 && slab > 0)
+        printf("%7ld\n", slab / armed);
+    else
+        printf("%7s\n", "-");
+    if(limit != 0)
+        printf("%-13s kernel limit after %d timers: %s\n", "", armed, strerror(limit));
+
+    if(queue != NULL){
+        queue_destroy(queue);
+        free(queue);
+    } else
+        ktimer_destroy(&kt);
+    free(late);
+    free(ids);
+    free(entries);
+    free(alarms);
+    return limit == 0;
+}
+
+//Raise a soft limit as far as the hard limit allows, and return it
+static long bench_raise_limit(int resource){
+    struct rlimit limit;
+
+    if(getrlimit(resource, &limit) != 0)
+        return -1;
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(resource, &limit);
+    getrlimit(resource, &limit);
+    return limit.rlim_cur == RLIM_INFINITY ? -1 : (long)limit.rlim_cur;
+}
+
+static void bench_kernel(int count, int cancel_percent){
+    int open[3] = { 1, 1, 1 };
+    int size, kind;
+
+    printf("kernel timers, alarms due 0.5-1s out (open files %ld, pending signals %ld)\n",
+           bench_raise_limit(RLIMIT_NOFILE), bench_raise_limit(RLIMIT_SIGPENDING));
+    printf("per alarm: ns to arm, cancel and fire (CPU), usec late, bytes of heap and kernel slab\n");
+    printf("%-13s %7s %10s %10s %10s %8s %8s %8s %8s %7s\n", "backend", "alarms",
+           "arm", "cancel", "fire cpu", "p50", "p99", "max", "heap", "slab");
+    for(size = 1000; ; size *= 10){
+        if(size > count)
+            size = count;
+        for(kind = -1; kind <= KTIMER_TIMERFD; kind++)
+            if(open[kind + 1])
+                open[kind + 1] = bench_kernel_run(kind, size, cancel_percent);
+        if(size == count)
+            break;
+    }
+}
+
+#define BENCH_FANIN_THREADS 64
+#define BENCH_FANIN_SHARDS 2
+
+//A shard as My_Alarm has them: a queue behind a lock
+typedef struct bench_shard {
+    pthread_mutex_t lock;
+    queue_t queue;
+    unsigned long locks;
+} bench_shard_t;
+
+static bench_shard_t bench_shards[BENCH_FANIN_SHARDS];
+static alarm_t * bench_fanin_alarms;
+static int bench_fanin_each, bench_fanin_batched;
+static pthread_barrier_t bench_fanin_start;
+
+//Flush hook, and the unbatched path with a count of 1
+static void bench_fanin_insert(alarm_t ** alarms, int count){
+    bench_shard_t * shard;
+    alarm_t * mine[BATCH_MAX];
+    struct timespec now;
+    int i, j, found;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for(i = 0; i < BENCH_FANIN_SHARDS; i++){
+        shard = &bench_shards[i];
+        for(j = found = 0; j < count; j++)
+            if(alarms[j]->time.tv_sec % BENCH_FANIN_SHARDS == i)
+                mine[found++] = alarms[j];
+        if(found == 0)
+            continue;
+        pthread_mutex_lock(&shard->lock);
+        shard->locks++;
+        queue_insert_batch(&shard->queue, mine, found, now.tv_sec);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+static void * bench_fanin_thread(void * arg){
+    long index = (long)arg;
+    alarm_t * alarm;
+    int i;
+
+    pthread_barrier_wait(&bench_fanin_start);
+    for(i = 0; i < bench_fanin_each; i++){
+        alarm = &bench_fanin_alarms[index * bench_fanin_each + i];
+        if(bench_fanin_batched)
+            batch_submit(alarm);
+        else
+            bench_fanin_insert(&alarm, 1);
+    }
+    if(bench_fanin_batched)
+        batch_flush();
+    return NULL;
+}
+
+/* Submit count alarms from BENCH_FANIN_THREADS threads at once, one
+ * shard lock per alarm (size 0) or in batches of size, and report
+ * the wall time and how often the shard locks were taken.
+ */
+static void bench_fanin_run(int size, int count){
+    pthread_t threads[BENCH_FANIN_THREADS];
+    unsigned int seed = 5;
+    unsigned long locks = 0, queued = 0;
+    struct timespec start, cpu, now;
+    long usec;
+    double wall, cpu_ns;
+    int i, status;
+
+    bench_fanin_each = count / BENCH_FANIN_THREADS;
+    count = bench_fanin_each * BENCH_FANIN_THREADS;
+    bench_fanin_alarms = calloc(count, sizeof(alarm_t));
+    if(bench_fanin_alarms == NULL)
+        errno_abort("Allocate benchmark");
+
+    //Up to an hour out, one in a hundred due almost at once
+    clock_gettime(CLOCK_REALTIME, &now);
+    for(i = 0; i < count; i++){
+        usec = rand_r(&seed) % 100 == 0 ? 10000 : 1000000L + rand_r(&seed) % 3600000000L;
+        bench_fanin_alarms[i].id = i + 1;
+        bench_fanin_alarms[i].time.tv_sec = now.tv_sec + (now.tv_nsec / 1000 + usec) / 1000000;
+        bench_fanin_alarms[i].time.tv_nsec = (now.tv_nsec / 1000 + usec) % 1000000 * 1000;
+    }
+    for(i = 0; i < BENCH_FANIN_SHARDS; i++){
+        pthread_mutex_init(&bench_shards[i].lock, NULL);
+        queue_init(&bench_shards[i].queue, 0);
+        queue_set_backend(&bench_shards[i].queue, QUEUE_HEAP);
+        bench_shards[i].locks = 0;
+    }
+    bench_fanin_batched = size > 0;
+    if(bench_fanin_batched && (status = batch_init(bench_fanin_insert, size)) != 0)
+        err_abort(status, "Start batching");
+
+    pthread_barrier_init(&bench_fanin_start, NULL, BENCH_FANIN_THREADS + 1);
+    for(i = 0; i < BENCH_FANIN_THREADS; i++){
+        status = pthread_create(&threads[i], NULL, bench_fanin_thread, (void *)(long)i);
+        if(status != 0)
+            err_abort(status, "Create submitter");
+    }
+    pthread_barrier_wait(&bench_fanin_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    for(i = 0; i < BENCH_FANIN_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    wall = bench_elapsed(&start);
+    cpu_ns = bench_elapsed_cpu(&cpu);
+    pthread_barrier_destroy(&bench_fanin_start);
+
+    for(i = 0; i < BENCH_FANIN_SHARDS; i++){
+        locks += bench_shards[i].locks;
+        queued += bench_shards[i].queue.depth;
+        queue_destroy(&bench_shards[i].queue);
+        pthread_mutex_destroy(&bench_shards[i].lock);
+    }
+    if(size > 0)
+        printf("batch %-4d", size);
+    else
+        printf("per alarm ");
+    printf(" %9d %9lu %11.1f %11.1f %12.0f %10.2f\n", count, locks, cpu_ns / count,
+           wall / count, count / (wall / 1e9), wall / 1e6);
+    if(queued != (unsigned long)count)
+        fprintf(stderr, "fanin: %lu of %d alarms queued\n", queued, count);
+    free(bench_fanin_alarms);
+}
+
+static void bench_fanin(int count){
+    int sizes[] = { 0, 8, 32, 128, BATCH_MAX };
+    int i;
+
+    printf("fan-in, %d threads submitting to %d heap shards\n", BENCH_FANIN_THREADS, BENCH_FANIN_SHARDS);
+    printf("path          alarms     locks  cpu ns/op  wall ns/op     alarms/s    wall ms\n");
+    for(i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+        bench_fanin_run(sizes[i], count);
+}
+
+/* Fire count alarms into a stdio stream on /dev/null, formatting
+ * each record at fire time as the display threads used to, and
+ * copying records rendered beforehand as they do now.
+ */
+static void bench_render(int count){
+    const char * format = "%Y-%m-%d %H:%M:%S";
+    alarm_t * alarms;
+    FILE * out;
+    struct tm local_time;
+    char local_str[DATEFORMAT_SIZE];
+    struct timespec start;
+    double at_fire, render, copy;
+    int i;
+
+    alarms = calloc(count, sizeof(alarm_t));
+    out = fopen("/dev/null", "w");
+    if(alarms == NULL || out == NULL)
+        errno_abort("Allocate benchmark");
+    for(i = 0; i < count; i++){
+        alarms[i].id = i + 1;
+        alarms[i].time.tv_sec = time(NULL) + i;
+        snprintf(alarms[i].message, sizeof(alarms[i].message), "benchmark alarm number %d", i);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < count; i++){
+        flockfile(out);
+        localtime_r(&alarms[i].time.tv_sec, &local_time);
+        strftime(local_str, DATEFORMAT_SIZE, format, &local_time);
+        fprintf(out, "\nDisplay Thread  %d: Alarm expired at %s: %s\n", 1, local_str, alarms[i].message);
+        fprintf(out, "alarm>");
+        funlockfile(out);
+    }
+    at_fire = bench_elapsed(&start);
+
+    //What the submitter now pays instead
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < count; i++){
+        localtime_r(&alarms[i].time.tv_sec, &local_time);
+        strftime(local_str, DATEFORMAT_SIZE, format, &local_time);
+        alarms[i].expiry_length = snprintf(alarms[i].expiry, EXPIRY_SIZE,
+                                           "\nDisplay Thread  %d: Alarm expired at %s: %s\nalarm>",
+                                           1, local_str, alarms[i].message);
+    }
+    render = bench_elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < count; i++){
+        flockfile(out);
+        fwrite_unlocked(alarms[i].expiry, 1, alarms[i].expiry_length, out);
+        funlockfile(out);
+    }
+    copy = bench_elapsed(&start);
+
+    printf("expiry records, %d alarms\n", count);
+    printf("formatted at fire   %8.1f ns/fire\n", at_fire / count);
+    printf("prerendered fire    %8.1f ns/fire (%.1fx less), rendering at submit %.1f ns/alarm\n",
+           copy / count, at_fire / copy, render / count);
+    fclose(out);
+    free(alarms);
+}
+
+//Single list inserts are quadratic; past this many they are not run
+#define BENCH_MERGE_SINGLE_MAX 10000
+#define BENCH_MERGE_REPEAT 10000
+
+//Random deadlines up to an hour out, ids from first
+static void bench_merge_fill(alarm_t * alarms, int count, unsigned long first, unsigned int * seed){
+    long usec;
+    int i;
+
+    memset(alarms, 0, count * sizeof(alarm_t));
+    for(i = 0; i < count; i++){
+        usec = rand_r(seed) % 3600000000L;
+        alarms[i].id = first + i;
+        alarms[i].time.tv_sec = BENCH_BASE_TIME + usec / 1000000;
+        alarms[i].time.tv_nsec = usec % 1000000 * 1000;
+    }
+}
+
+/* Put size alarms on a queue already holding resident ones, singly
+ * or as one batch, and return the ns per alarm. Small batches are
+ * repeated, cancelling each before the next, until about
+ * BENCH_MERGE_REPEAT alarms have gone in. ids, if not NULL, gets the
+ * order the last batch and the resident alarms then pop in; the pops
+ * check it is soonest first.
+ */
+static double bench_merge_run(int backend, int resident, int size, int batched, unsigned long * ids){
+    queue_t queue;
+    alarm_t * alarms, ** batch, * alarm;
+    struct timespec start, last = { 0, 0 };
+    unsigned int seed = 11;
+    double elapsed = 0;
+    int i, rep, reps = size < BENCH_MERGE_REPEAT ? BENCH_MERGE_REPEAT / size : 1;
+
+    alarms = malloc((resident + size) * sizeof(alarm_t));
+    batch = malloc(size * sizeof(alarm_t *));
+    if(alarms == NULL || batch == NULL)
+        errno_abort("Allocate benchmark");
+    bench_merge_fill(alarms, resident + size, 1, &seed);
+
+    queue_init(&queue, 0);
+    queue_set_backend(&queue, backend);
+    for(i = 0; i < resident; i++)
+        queue_insert(&queue, &alarms[i], BENCH_BASE_TIME);
+    for(i = 0; i < size; i++)
+        batch[i] = &alarms[resident + i];
+
+    for(rep = 0; rep < reps; rep++){
+        if(rep > 0)
+            for(i = 0; i < size; i++)
+                queue_cancel(&queue, batch[i]->id);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(batched)
+            queue_insert_batch(&queue, batch, size, BENCH_BASE_TIME);
+        else
+            for(i = 0; i < size; i++)
+                queue_insert(&queue, batch[i], BENCH_BASE_TIME);
+        elapsed += bench_elapsed(&start);
+    }
+
+    for(i = 0; (alarm = queue_pop(&queue)) != NULL; i++){
+        if(alarm->time.tv_sec < last.tv_sec
+           || (alarm->time.tv_sec == last.tv_sec && alarm->time.tv_nsec < last.tv_nsec))
+            fprintf(stderr, "merge: alarm %lu popped out of order\n", alarm->id);
+        last = alarm->time;
+        if(ids != NULL)
+            ids[i] = alarm->id;
+    }
+    if(i != resident + size)
+        fprintf(stderr, "merge: %d of %d alarms popped\n", i, resident + size);
+    queue_destroy(&queue);
+    free(batch);
+    free(alarms);
+    return elapsed / ((double)size * reps);
+}
+
+static void bench_merge(int resident){
+    int sizes[] = { 10, 100, 1000, 10000, 100000 };
+    int backends[] = { QUEUE_LIST, QUEUE_HEAP };
+    unsigned long * single_ids, * batch_ids;
+    double single, merged;
+    int b, i, size;
+
+    printf("batches arriving at a queue of %d alarms, up to an hour out\n", resident);
+    printf("backend    batch   single ns/op   merged ns/op  speedup\n");
+    for(b = 0; b < 2; b++){
+        for(i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++){
+            size = sizes[i];
+            single_ids = malloc((resident + size) * sizeof(unsigned long));
+            batch_ids = malloc((resident + size) * sizeof(unsigned long));
+            if(single_ids == NULL || batch_ids == NULL)
+                errno_abort("Allocate benchmark");
+            merged = bench_merge_run(backends[b], resident, size, 1, batch_ids);
+            printf("%-7s %8d", queue_backend_name(backends[b]), size);
+            if(backends[b] == QUEUE_LIST && size > BENCH_MERGE_SINGLE_MAX){
+                printf("        not run %14.1f\n", merged);
+            } else {
+                single = bench_merge_run(backends[b], resident, size, 0, single_ids);
+                printf(" %14.1f %14.1f %7.1fx\n", single, merged, single / merged);
+                //The list merge keeps exactly the order single inserts give
+                if(backends[b] == QUEUE_LIST
+                   && memcmp(single_ids, batch_ids, (resident + size) * sizeof(unsigned long)) != 0)
+                    fprintf(stderr, "merge: batch of %d fires in a different order\n", size);
+            }
+            free(single_ids);
+            free(batch_ids);
+        }
+    }
+}
+
+#define BENCH_SPREAD_SECONDS 5
+
+/* Queue count alarms due at the same moment, with a spread window of
+ * window_ms, and pop them all as simulated time passes, counting the
+ * fires in each second from the deadline on.
+ */
+static void bench_spread_run(int count, int window_ms){
+    unsigned long fires[BENCH_SPREAD_SECONDS + 1] = { 0 };
+    struct timespec deadline;
+    queue_t queue;
+    alarm_t * alarms, * alarm;
+    long long late, latest = 0;
+    unsigned long past = 0, peak = 0;
+    int i, second;
+
+    alarms = calloc(count, sizeof(alarm_t));
+    if(alarms == NULL)
+        errno_abort("Allocate benchmark");
+    queue_init(&queue, 0);
+    queue_set_backend(&queue, QUEUE_HEAP);
+    for(i = 0; i < count; i++){
+        alarms[i].id = i + 1;
+        alarms[i].time.tv_sec = BENCH_BASE_TIME + 10;
+        alarms[i].spread_ms = window_ms;
+        queue_insert(&queue, &alarms[i], BENCH_BASE_TIME);
+    }
+
+    while((alarm = queue_head(&queue)) != NULL){
+        deadline = queue_deadline(&queue, alarm);
+        alarm = queue_pop(&queue);
+        //Fired at its spread time; its own deadline is back in time
+        late = (long long)(deadline.tv_sec - alarm->time.tv_sec) * 1000000LL
+               + (deadline.tv_nsec - alarm->time.tv_nsec) / 1000;
+        if(late > latest)
+            latest = late;
+        if(late < 0 || late > window_ms * 1000LL)
+            past++;
+        second = late / 1000000;
+        fires[second < BENCH_SPREAD_SECONDS ? second : BENCH_SPREAD_SECONDS]++;
+    }
+
+    printf("%6d ms", window_ms);
+    for(second = 0; second <= BENCH_SPREAD_SECONDS; second++){
+        printf(" %8lu", fires[second]);
+        if(fires[second] > peak)
+            peak = fires[second];
+    }
+    printf(" %8lu %9.1f %6lu\n", peak, latest / 1000.0, past);
+    queue_destroy(&queue);
+    free(alarms);
+}
+
+static void bench_spread(int count){
+    int windows[] = { 0, 1000, 2500, BENCH_SPREAD_SECONDS * 1000 };
+    int i;
+
+    printf("%d alarms due at once, fires per second after the deadline\n", count);
+    printf("window       +0s      +1s      +2s      +3s      +4s     +5s~     peak latest ms   past\n");
+    for(i = 0; i < (int)(sizeof(windows) / sizeof(windows[0])); i++)
+        bench_spread_run(count, windows[i]);
+}
+
+int main(int argc, char * argv[]){
+    const char * workload = argc > 1 ? argv[1] : "all";
+    int count = argc > 2 ? atoi(argv[2]) : 20000;
+    int cancel_percent = argc > 3 ? atoi(argv[3]) : 90;
+
+    if(count <= 0 || cancel_percent < 0 || cancel_percent > 100){
+        fprintf(stderr, "Usage: %s [workload] [alarms] [cancel percent]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if(strcmp(workload, "all") == 0 || strcmp(workload, "cancel") == 0)
+        bench_cancel(count, cancel_percent);
+    if(strcmp(workload, "all") == 0 || strcmp(workload, "range") == 0)
+        bench_range(count);
+    if(strcmp(workload, "all") == 0 || strcmp(workload, "backend") == 0)
+        bench_backend(count, cancel_percent);
+    if(strcmp(workload, "all") == 0 || strcmp(workload, "kernel") == 0)
+        bench_kernel(count, cancel_percent);
+    if(strcmp(workload, "all") == 0 || strcmp(workload, "fanin") == 0)
+        bench_fanin(count * 10);
+    if(strcmp(workload, "all") == 0 || strcmp(workload, "render") == 0)
+        bench_render(count * 10);
+    if(strcmp(workload, "all") == 0 || strcmp(workload, "merge") == 0)
+        bench_merge(count / 10);
+    if(strcmp(workload, "all") == 0 || strcmp(workload, "spread") == 0)
+        bench_spread(count * 5);
+
+    return 0;
+}
@@ -0,0 +1,294 @@
+/*
+ * btree.c
+ *
+ * Counted B+tree. Keys are kept in their own arrays so a node's keys
+ * sit in a few cache lines and are binary searched; the slot array
+ * is only touched once the position is known. Each internal node
+ * stores the least key and the entry count of every child.
+ *
+ * Deletion does not rebalance: nodes shrink until they are empty and
+ * are then freed. The height only ever reflects the largest the tree
+ * has been, which for a timer queue is the steady state anyway.
+ */
+#include "errors.h"
+#include "btree.h"
+
+#define BT_LESS(w1, i1, w2, i2) ((w1) < (w2) || ((w1) == (w2) && (i1) < (i2)))
+
+//First slot whose key is not less than key
+static int bt_lower(bt_node_t * node, bt_key_t key){
+    int low = 0, high = node->count, middle;
+
+    while(low < high){
+        middle = (low + high) / 2;
+        if(BT_LESS(node->when[middle], node->ids[middle], key.when, key.id))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+//Child of an internal node that key belongs under
+static int bt_child(bt_node_t * node, bt_key_t key){
+    int low = 0, high = node->count, middle;
+
+    //First child whose least key is greater than key...
+    while(low < high){
+        middle = (low + high) / 2;
+        if(BT_LESS(key.when, key.id, node->when[middle], node->ids[middle]))
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    //...so key goes under the one before it
+    return low > 0 ? low - 1 : 0;
+}
+
+//Make room at pos
+static void bt_open(bt_node_t * node, int pos){
+    int move = node->count - pos;
+
+    memmove(&node->when[pos + 1], &node->when[pos], move * sizeof(long long));
+    memmove(&node->ids[pos + 1], &node->ids[pos], move * sizeof(unsigned long));
+    memmove(&node->sizes[pos + 1], &node->sizes[pos], move * sizeof(unsigned long));
+    memmove(&node->slots[pos + 1], &node->slots[pos], move * sizeof(void *));
+}
+
+//Close the gap at pos
+static void bt_close(bt_node_t * node, int pos){
+    int move = node->count - pos - 1;
+
+    memmove(&node->when[pos], &node->when[pos + 1], move * sizeof(long long));
+    memmove(&node->ids[pos], &node->ids[pos + 1], move * sizeof(unsigned long));
+    memmove(&node->sizes[pos], &node->sizes[pos + 1], move * sizeof(unsigned long));
+    memmove(&node->slots[pos], &node->slots[pos + 1], move * sizeof(void *));
+}
+
+static unsigned long bt_node_size(bt_node_t * node){
+    unsigned long size = 0;
+    int i;
+
+    if(node->leaf)
+        return node->count;
+    for(i = 0; i < node->count; i++)
+        size += node->sizes[i];
+    return size;
+}
+
+static bt_node_t * bt_new_node(int leaf){
+    bt_node_t * node = calloc(1, sizeof(bt_node_t));
+
+    if(node == NULL)
+        errno_abort("Allocate index node");
+    node->leaf = leaf;
+    return node;
+}
+
+//Move the upper half of an overflowing node into a new right sibling.
+static bt_node_t * bt_split(bt_node_t * node){
+    bt_node_t * right = bt_new_node(node->leaf);
+    int half = node->count / 2;
+
+    right->count = node->count - half;
+    memcpy(right->when, &node->when[half], right->count * sizeof(long long));
+    memcpy(right->ids, &node->ids[half], right->count * sizeof(unsigned long));
+    memcpy(right->sizes, &node->sizes[half], right->count * sizeof(unsigned long));
+    memcpy(right->slots, &node->slots[half], right->count * sizeof(void *));
+    node->count = half;
+
+    if(node->leaf){
+        right->next = node->next;
+        if(right->next != NULL)
+            right->next->prev = right;
+        right->prev = node;
+        node->next = right;
+    }
+    return right;
+}
+
+//Insert below node. Returns the new right sibling if node had to split.
+static bt_node_t * bt_insert_node(bt_node_t * node, bt_key_t key, void * value){
+    bt_node_t * child, * split;
+    int pos;
+
+    if(node->leaf){
+        pos = bt_lower(node, key);
+        bt_open(node, pos);
+        node->when[pos] = key.when;
+        node->ids[pos] = key.id;
+        node->slots[pos] = value;
+        node->count++;
+    } else {
+        pos = bt_child(node, key);
+        child = node->slots[pos];
+        split = bt_insert_node(child, key, value);
+        node->sizes[pos]++;
+        if(BT_LESS(key.when, key.id, node->when[pos], node->ids[pos])){
+            node->when[pos] = key.when;
+            node->ids[pos] = key.id;
+        }
+        if(split != NULL){
+            node->sizes[pos] = bt_node_size(child);
+            bt_open(node, pos + 1);
+            node->when[pos + 1] = split->when[0];
+            node->ids[pos + 1] = split->ids[0];
+            node->sizes[pos + 1] = bt_node_size(split);
+            node->slots[pos + 1] = split;
+            node->count++;
+        }
+    }
+
+    if(node->count > BT_FANOUT)
+        return bt_split(node);
+    return NULL;
+}
+
+//Remove key from below node. Returns its value, or NULL if absent.
+static void * bt_remove_node(bt_node_t * node, bt_key_t key){
+    bt_node_t * child;
+    void * value;
+    int pos;
+
+    if(node->leaf){
+        pos = bt_lower(node, key);
+        if(pos == node->count || node->when[pos] != key.when || node->ids[pos] != key.id)
+            return NULL;
+        value = node->slots[pos];
+        bt_close(node, pos);
+        node->count--;
+        return value;
+    }
+
+    pos = bt_child(node, key);
+    child = node->slots[pos];
+    value = bt_remove_node(child, key);
+    if(value == NULL)
+        return NULL;
+
+    node->sizes[pos]--;
+    if(child->count == 0){
+        if(child->leaf){
+            if(child->prev != NULL)
+                child->prev->next = child->next;
+            if(child->next != NULL)
+                child->next->prev = child->prev;
+        }
+        free(child);
+        bt_close(node, pos);
+        node->count--;
+    } else {
+        node->when[pos] = child->when[0];
+        node->ids[pos] = child->ids[0];
+    }
+    return value;
+}
+
+static void bt_free_node(bt_node_t * node){
+    int i;
+
+    if(!node->leaf)
+        for(i = 0; i < node->count; i++)
+            bt_free_node(node->slots[i]);
+    free(node);
+}
+
+void bt_init(btree_t * tree){
+    tree->root = NULL;
+    tree->size = 0;
+}
+
+void bt_destroy(btree_t * tree){
+    if(tree->root != NULL)
+        bt_free_node(tree->root);
+    bt_init(tree);
+}
+
+void bt_insert(btree_t * tree, bt_key_t key, alarm_t * alarm){
+    bt_node_t * split, * root;
+
+    if(tree->root == NULL)
+        tree->root = bt_new_node(1);
+
+    split = bt_insert_node(tree->root, key, alarm);
+    if(split != NULL){
+        root = bt_new_node(0);
+        root->count = 2;
+        root->when[0] = tree->root->when[0];
+        root->ids[0] = tree->root->ids[0];
+        root->sizes[0] = bt_node_size(tree->root);
+        root->slots[0] = tree->root;
+        root->when[1] = split->when[0];
+        root->ids[1] = split->ids[0];
+        root->sizes[1] = bt_node_size(split);
+        root->slots[1] = split;
+        tree->root = root;
+    }
+    tree->size++;
+}
+
+alarm_t * bt_remove(btree_t * tree, bt_key_t key){
+    bt_node_t * root;
+    alarm_t * alarm;
+
+    if(tree->root == NULL)
+        return NULL;
+
+    alarm = bt_remove_node(tree->root, key);
+    if(alarm == NULL)
+        return NULL;
+    tree->size--;
+
+    //Drop roots left with a single child, or nothing at all
+    while(!tree->root->leaf && tree->root->count == 1){
+        root = tree->root;
+        tree->root = root->slots[0];
+        free(root);
+    }
+    if(tree->root->count == 0){
+        free(tree->root);
+        tree->root = NULL;
+    }
+    return alarm;
+}
+
+//Number of entries less than key.
+unsigned long bt_rank(btree_t * tree, bt_key_t key){
+    bt_node_t * node = tree->root;
+    unsigned long rank = 0;
+    int pos, i;
+
+    if(node == NULL)
+        return 0;
+
+    while(!node->leaf){
+        pos = bt_child(node, key);
+        for(i = 0; i < pos; i++)
+            rank += node->sizes[i];
+        node = node->slots[pos];
+    }
+    return rank + bt_lower(node, key);
+}
+
+/* Store up to max alarms with from <= key < to into out, in
+ * order, and return how many were stored.
+ */
+int bt_range(btree_t * tree, bt_key_t from, bt_key_t to, alarm_t ** out, int max){
+    bt_node_t * node = tree->root;
+    int pos, found = 0;
+
+    if(node == NULL)
+        return 0;
+
+    while(!node->leaf)
+        node = node->slots[bt_child(node, from)];
+
+    for(pos = bt_lower(node, from); node != NULL; node = node->next, pos = 0){
+        for(; pos < node->count; pos++){
+            if(!BT_LESS(node->when[pos], node->ids[pos], to.when, to.id) || found == max)
+                return found;
+            out[found++] = node->slots[pos];
+        }
+    }
+    return found;
+}
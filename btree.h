@@ -0,0 +1,46 @@
+#ifndef __btree_h
+#define __btree_h
+
+#include "alarm.h"
+
+/*
+ * btree.h
+ *
+ * B+tree over (deadline, id) pairs, pointing at alarms. Internal
+ * nodes keep the number of entries below each child, so the rank of
+ * any key, and therefore the number of alarms in any window, is one
+ * walk from the root. Leaves are chained for listing a window in
+ * order.
+ */
+
+#define BT_FANOUT 32
+
+typedef struct bt_key {
+    long long when;         /* microseconds, queue relative */
+    unsigned long id;
+} bt_key_t;
+
+typedef struct bt_node {
+    int leaf;
+    int count;
+    //One spare slot, so a node can overflow before it is split
+    long long when[BT_FANOUT + 1];          /* leaf: entry keys, internal: least key below each child */
+    unsigned long ids[BT_FANOUT + 1];
+    unsigned long sizes[BT_FANOUT + 1];     /* internal: entries below each child */
+    void * slots[BT_FANOUT + 1];            /* leaf: alarm_t *, internal: bt_node_t * */
+    struct bt_node * prev, * next;          /* leaf chain */
+} bt_node_t;
+
+typedef struct btree {
+    bt_node_t * root;
+    unsigned long size;
+} btree_t;
+
+void bt_init(btree_t * tree);
+void bt_destroy(btree_t * tree);
+void bt_insert(btree_t * tree, bt_key_t key, alarm_t * alarm);
+alarm_t * bt_remove(btree_t * tree, bt_key_t key);
+unsigned long bt_rank(btree_t * tree, bt_key_t key);
+int bt_range(btree_t * tree, bt_key_t from, bt_key_t to, alarm_t ** out, int max);
+
+#endif
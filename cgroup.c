@@ -0,0 +1,233 @@
+/*
+ * cgroup.c
+ *
+ * Container limits, see cgroup.h. A limit set on any cgroup above
+ * ours applies too, so each one is read from our cgroup's directory
+ * and from every parent up to the mount point, keeping the lowest.
+ */
+#define _GNU_SOURCE
+#include <sched.h>
+#include <time.h>
+#include <malloc.h>
+#include "errors.h"
+#include "cgroup.h"
+
+#define CGROUP_PATH_SIZE 512
+
+static cgroup_limits_t cgroup_limits = { 0, 1, -1, 0, 1, -1, -1 };
+static int cgroup_spinners;
+static long cgroup_relax_usec;
+static int cgroup_arenas;
+
+//Mount points of the v2 hierarchy and the v1 cpu and memory controllers
+static char cgroup_mount_v2[CGROUP_PATH_SIZE];
+static char cgroup_mount_cpu[CGROUP_PATH_SIZE];
+static char cgroup_mount_memory[CGROUP_PATH_SIZE];
+
+//Whether controller is one of the comma separated names in list
+static int cgroup_has(const char * list, const char * controller){
+    size_t length = strlen(controller);
+    const char * at;
+
+    for(at = list; (at = strstr(at, controller)) != NULL; at += length)
+        if((at == list || at[-1] == ',') && (at[length] == ',' || at[length] == '\0'))
+            return 1;
+    return 0;
+}
+
+//Find the cgroup mounts in /proc/self/mountinfo.
+static void cgroup_find_mounts(void){
+    FILE * mounts = fopen("/proc/self/mountinfo", "r");
+    char line[1024], mount[CGROUP_PATH_SIZE], type[32], options[256];
+    char * dash;
+
+    if(mounts == NULL)
+        return;
+    while(fgets(line, sizeof(line), mounts) != NULL){
+        //mount point is the fifth field; type and super options follow the " - "
+        dash = strstr(line, " - ");
+        if(dash == NULL || sscanf(line, "%*s %*s %*s %*s %511s", mount) != 1
+           || sscanf(dash, " - %31s %*s %255s", type, options) != 2)
+            continue;
+        if(strcmp(type, "cgroup2") == 0 && cgroup_mount_v2[0] == '\0')
+            snprintf(cgroup_mount_v2, sizeof(cgroup_mount_v2), "%s", mount);
+        else if(strcmp(type, "cgroup") == 0){
+            if(cgroup_has(options, "cpu") && cgroup_mount_cpu[0] == '\0')
+                snprintf(cgroup_mount_cpu, sizeof(cgroup_mount_cpu), "%s", mount);
+            if(cgroup_has(options, "memory") && cgroup_mount_memory[0] == '\0')
+                snprintf(cgroup_mount_memory, sizeof(cgroup_mount_memory), "%s", mount);
+        }
+    }
+    fclose(mounts);
+}
+
+/* Our path in the hierarchy with controller ("" for v2), from
+ * /proc/self/cgroup. Returns 0 if we are in one.
+ */
+static int cgroup_path(const char * controller, char * path, size_t size){
+    FILE * groups = fopen("/proc/self/cgroup", "r");
+    char line[1024], * list, * where;
+    int found = 0;
+
+    if(groups == NULL)
+        return -1;
+    while(!found && fgets(line, sizeof(line), groups) != NULL){
+        line[strcspn(line, "\n")] = '\0';
+        list = strchr(line, ':');
+        where = list == NULL ? NULL : strchr(list + 1, ':');
+        if(where == NULL)
+            continue;
+        *where++ = '\0';
+        list++;
+        if(controller[0] == '\0' ? list[0] == '\0' : cgroup_has(list, controller)){
+            snprintf(path, size, "%s", strcmp(where, "/") == 0 ? "" : where);
+            found = 1;
+        }
+    }
+    fclose(groups);
+    return found ? 0 : -1;
+}
+
+/* Read a file of one or two numbers, where "max" (v2) or a huge
+ * value (v1) means no limit. Returns the number of values read.
+ */
+static int cgroup_read(const char * path, long long * first, long long * second){
+    FILE * file = fopen(path, "r");
+    char word[32];
+    int got = 0;
+
+    if(file == NULL)
+        return 0;
+    if(fscanf(file, "%31s", word) == 1){
+        *first = strcmp(word, "max") == 0 ? -1 : atoll(word);
+        if(*first >= (1LL << 62))
+            *first = -1;
+        got = 1;
+        if(second != NULL && fscanf(file, "%lld", second) == 1)
+            got = 2;
+    }
+    fclose(file);
+    return got;
+}
+
+/* Lowest limit in file, in the cgroup at path under mount and all
+ * its parents. For "cpu.max" the quota is scaled to period_usec.
+ * Returns -1 if there is none.
+ */
+static long long cgroup_lowest(const char * mount, const char * path, const char * file, long long * period_usec){
+    char dir[CGROUP_PATH_SIZE], name[CGROUP_PATH_SIZE * 2];
+    long long value, period, lowest = -1;
+    char * slash;
+    int got;
+
+    snprintf(dir, sizeof(dir), "%s%s", mount, path);
+    while(1){
+        snprintf(name, sizeof(name), "%s/%s", dir, file);
+        period = 0;
+        got = cgroup_read(name, &value, period_usec != NULL ? &period : NULL);
+        //v1 keeps the period in a file of its own
+        if(got == 1 && period_usec != NULL){
+            snprintf(name, sizeof(name), "%s/cpu.cfs_period_us", dir);
+            cgroup_read(name, &period, NULL);
+        }
+        if(got > 0 && value > 0 && period_usec != NULL && period > 0){
+            //Compare quotas as CPUs, in millionths
+            if(lowest < 0 || value * 1000000 / period < lowest * 1000000 / *period_usec){
+                lowest = value;
+                *period_usec = period;
+            }
+        } else if(got > 0 && value >= 0 && period_usec == NULL && (lowest < 0 || value < lowest))
+            lowest = value;
+
+        if(strlen(dir) <= strlen(mount))
+            break;
+        slash = strrchr(dir, '/');
+        if(slash == NULL)
+            break;
+        *slash = '\0';
+    }
+    return lowest;
+}
+
+/* Read the limits and size to them, for spinners busy-waiting
+ * threads. Call before starting any threads. Returns the number of
+ * usable CPUs.
+ */
+int cgroup_init(int spinners){
+    cgroup_limits_t * limits = &cgroup_limits;
+    char path[CGROUP_PATH_SIZE];
+    cpu_set_t affinity;
+    int quota_cpus;
+
+    if(sched_getaffinity(0, sizeof(affinity), &affinity) == 0)
+        limits->affinity_cpus = CPU_COUNT(&affinity);
+    else
+        limits->affinity_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    cgroup_find_mounts();
+    if(cgroup_mount_v2[0] != '\0' && cgroup_path("", path, sizeof(path)) == 0){
+        limits->quota_usec = cgroup_lowest(cgroup_mount_v2, path, "cpu.max", &limits->period_usec);
+        limits->memory_max = cgroup_lowest(cgroup_mount_v2, path, "memory.max", NULL);
+        limits->memory_high = cgroup_lowest(cgroup_mount_v2, path, "memory.high", NULL);
+        if(limits->quota_usec > 0 || limits->memory_max >= 0 || limits->memory_high >= 0)
+            limits->version = 2;
+    }
+    if(limits->version == 0){
+        if(cgroup_mount_cpu[0] != '\0' && cgroup_path("cpu", path, sizeof(path)) == 0)
+            limits->quota_usec = cgroup_lowest(cgroup_mount_cpu, path, "cpu.cfs_quota_us", &limits->period_usec);
+        if(cgroup_mount_memory[0] != '\0' && cgroup_path("memory", path, sizeof(path)) == 0)
+            limits->memory_max = cgroup_lowest(cgroup_mount_memory, path, "memory.limit_in_bytes", NULL);
+        if(limits->quota_usec > 0 || limits->memory_max >= 0)
+            limits->version = 1;
+    }
+
+    limits->cpus = limits->affinity_cpus > 0 ? limits->affinity_cpus : 1;
+    if(limits->quota_usec > 0 && limits->period_usec > 0){
+        //A partly used CPU still runs a thread, so round up
+        quota_cpus = (limits->quota_usec + limits->period_usec - 1) / limits->period_usec;
+        if(quota_cpus < limits->cpus)
+            limits->cpus = quota_cpus;
+    }
+
+    cgroup_arenas = limits->cpus;
+    mallopt(M_ARENA_MAX, cgroup_arenas);
+
+    cgroup_spinners = spinners;
+    //A whole CPU per spinner, with one left over for everything else
+    cgroup_relax_usec = limits->cpus > spinners ? 0 : CGROUP_RELAX_USEC;
+    if(limits->quota_usec > 0 && limits->quota_usec < (long long)spinners * limits->period_usec)
+        cgroup_relax_usec = CGROUP_RELAX_USEC;
+    return limits->cpus;
+}
+
+//Called by busy-wait loops on every idle turn.
+void cgroup_relax(void){
+    struct timespec pause;
+
+    if(cgroup_relax_usec == 0)
+        return;
+    pause.tv_sec = 0;
+    pause.tv_nsec = cgroup_relax_usec * 1000;
+    nanosleep(&pause, NULL);
+}
+
+void cgroup_stats(FILE * out){
+    cgroup_limits_t * limits = &cgroup_limits;
+
+    fprintf(out, "Resources: %d CPUs usable (%d in affinity", limits->cpus, limits->affinity_cpus);
+    if(limits->quota_usec > 0)
+        fprintf(out, ", cgroup v%d quota %.2f CPUs", limits->version,
+                (double)limits->quota_usec / limits->period_usec);
+    fprintf(out, "), memory max ");
+    if(limits->memory_max >= 0)
+        fprintf(out, "%lld MB", limits->memory_max >> 20);
+    else
+        fprintf(out, "none");
+    if(limits->memory_high >= 0)
+        fprintf(out, " high %lld MB", limits->memory_high >> 20);
+    fprintf(out, ", %d malloc arenas, %d spinning threads ", cgroup_arenas, cgroup_spinners);
+    if(cgroup_relax_usec > 0)
+        fprintf(out, "sleep %ldus when idle\n", cgroup_relax_usec);
+    else
+        fprintf(out, "spin\n");
+}
@@ -0,0 +1,42 @@
+#ifndef __cgroup_h
+#define __cgroup_h
+
+#include <stdio.h>
+
+/*
+ * cgroup.h
+ *
+ * Container limits. cgroup_init reads the affinity mask and the CPU
+ * and memory limits of the cgroups the process is in (v2, or the v1
+ * cpu and memory controllers when there is no v2 limit), and sizes
+ * things to the CPUs actually available rather than the host's:
+ *
+ * - glibc's malloc arenas, by default eight per host CPU, are capped
+ *   at the number of usable CPUs.
+ * - The busy-wait loops (the alarm thread's wait for the next
+ *   request, main's wait for a receipt, and the last few hundred
+ *   microseconds before a display thread's next alarm) call
+ *   cgroup_relax when idle. With a CPU for every spinning
+ *   thread that does nothing; with fewer, each idle turn sleeps
+ *   CGROUP_RELAX_USEC, so the spinners don't use up the CFS quota
+ *   and get the whole process throttled for the rest of the period.
+ */
+
+//Idle poll sleep when there are fewer CPUs than spinning threads
+#define CGROUP_RELAX_USEC 200
+
+typedef struct cgroup_limits {
+    int version;                /* cgroup version the limits came from, 0 for none */
+    int affinity_cpus;          /* CPUs in the affinity mask */
+    long long quota_usec;       /* CPU time per period, -1 for no quota */
+    long long period_usec;
+    int cpus;                   /* usable CPUs: affinity, capped by the quota */
+    long long memory_max;       /* bytes, -1 for no limit */
+    long long memory_high;
+} cgroup_limits_t;
+
+int cgroup_init(int spinners);
+void cgroup_relax(void);
+void cgroup_stats(FILE * out);
+
+#endif
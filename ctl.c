@@ -0,0 +1,463 @@
+/*
+ * ctl.c
+ *
+ * Stats socket. One thread polls the listening socket and every
+ * connection, so an idle client costs a file descriptor and a line
+ * buffer. Replies are formatted into memory first and written in one
+ * go. Connections are non-blocking: whatever a client is too slow to
+ * take is kept in its backlog and sent when poll says there is room,
+ * so it never holds up the others.
+ *
+ * Queries:
+ *   stats            totals and the last complete second
+ *   history [n]      per-second history, last n seconds (default all)
+ *   await <id>       answered "fired <id>" or "cancelled <id>" once the
+ *                    alarm is off its queue, "unknown <id>" straight
+ *                    away if it isn't pending. A client can have any
+ *                    number outstanding and go on with other queries.
+ *   <secs> <message> submit an alarm, answered "alarm <id>"; its expiry
+ *                    arrives later as "expired <id> at <time>: <message>"
+ *                    on this connection only
+ *
+ * An origin names a connection slot and its generation, so an expiry
+ * for a connection that has since closed is dropped rather than sent
+ * to whoever has the slot now. Display threads push expiries onto the
+ * slot's lock-free outbox and bump the eventfd; this thread writes
+ * them out.
+ *
+ * Awaits park a waiter on the alarm (see await.h). The display thread
+ * that wakes it pushes it onto a lock-free done list and bumps an
+ * eventfd in the poll set, and this thread writes the answer.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "errors.h"
+#include "ctl.h"
+#include "metrics.h"
+#include "await.h"
+#include "output.h"
+#include "batch.h"
+#include "cgroup.h"
+#include "pipeline.h"
+
+#define CTL_MAX_CLIENTS 32
+#define CTL_LINE_SIZE 128
+//Unsent bytes a connection may have: past the first its queries wait,
+//past the second it is closed
+#define CTL_BACKLOG_PAUSE (64 * 1024)
+#define CTL_BACKLOG_MAX (1024 * 1024)
+
+typedef struct ctl_message {
+    struct ctl_message * next;
+    unsigned int generation;
+    int length;
+    char text[];
+} ctl_message_t;
+
+typedef struct ctl_client {
+    int fd;
+    int used;
+    unsigned int generation;        /* bumped on close, so late answers are dropped */
+    ctl_message_t * outbox;         /* pushed by display threads, newest first */
+    char line[CTL_LINE_SIZE];
+    char * backlog;                 /* replied but not sent yet */
+    size_t backlog_length;
+    size_t backlog_capacity;
+} ctl_client_t;
+
+typedef struct ctl_waiter {
+    waiter_t waiter;
+    int client;
+    unsigned int generation;
+} ctl_waiter_t;
+
+static int ctl_listen_fd = -1;
+static int ctl_wake_fd = -1;
+static ctl_client_t ctl_clients[CTL_MAX_CLIENTS];
+//Woken awaits not answered yet, pushed by display threads
+static waiter_t * ctl_done = NULL;
+static ctl_submit_t ctl_submit = NULL;
+
+static void ctl_close(ctl_client_t * client){
+    close(client->fd);
+    client->fd = -1;
+    client->used = 0;
+    client->generation++;
+    free(client->backlog);
+    client->backlog = NULL;
+    client->backlog_length = client->backlog_capacity = 0;
+}
+
+/* Send as much of buffer as the socket takes now. Returns how much,
+ * or -1 if the connection is gone.
+ */
+static ssize_t ctl_send(int fd, const char * buffer, size_t length){
+    ssize_t written;
+    size_t sent = 0;
+
+    while(sent < length){
+        written = send(fd, buffer + sent, length - sent, MSG_NOSIGNAL);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(written <= 0)
+            return -1;
+        sent += written;
+    }
+    return sent;
+}
+
+/* Reply to a client without blocking. What the socket won't take
+ * now goes on the end of its backlog, behind anything already there.
+ * A client that lets the backlog grow past CTL_BACKLOG_MAX is closed.
+ */
+static void ctl_reply(ctl_client_t * client, const char * buffer, size_t length){
+    ssize_t sent = 0;
+    size_t capacity;
+    char * grown;
+
+    if(client->backlog_length == 0){
+        sent = ctl_send(client->fd, buffer, length);
+        //Gone: the read side closes it
+        if(sent < 0)
+            return;
+    }
+    buffer += sent;
+    length -= sent;
+    if(length == 0)
+        return;
+
+    if(client->backlog_length + length > CTL_BACKLOG_MAX){
+        ctl_close(client);
+        return;
+    }
+    capacity = client->backlog_capacity ? client->backlog_capacity : 4096;
+    while(capacity < client->backlog_length + length)
+        capacity *= 2;
+    if(capacity != client->backlog_capacity){
+        grown = realloc(client->backlog, capacity);
+        if(grown == NULL){
+            ctl_close(client);
+            return;
+        }
+        client->backlog = grown;
+        client->backlog_capacity = capacity;
+    }
+    memcpy(client->backlog + client->backlog_length, buffer, length);
+    client->backlog_length += length;
+}
+
+//The socket has room: send what it will take of the backlog.
+static void ctl_drain(ctl_client_t * client){
+    ssize_t sent = ctl_send(client->fd, client->backlog, client->backlog_length);
+
+    if(sent < 0){
+        ctl_close(client);
+        return;
+    }
+    client->backlog_length -= sent;
+    memmove(client->backlog, client->backlog + sent, client->backlog_length);
+}
+
+//Get the socket thread to look at its done list and outboxes.
+static void ctl_wake(void){
+    unsigned long long one = 1;
+
+    if(write(ctl_wake_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+//Called by whoever woke an await: hand it to the socket thread.
+static void ctl_notify(waiter_t * waiter){
+    waiter_t * head = __atomic_load_n(&ctl_done, __ATOMIC_RELAXED);
+
+    do
+        waiter->next = head;
+    while(!__atomic_compare_exchange_n(&ctl_done, &head, waiter, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    ctl_wake();
+}
+
+static unsigned long ctl_origin(ctl_client_t * client){
+    return (unsigned long)client->generation * CTL_MAX_CLIENTS + (client - ctl_clients) + 1;
+}
+
+/* Queue text for the connection an alarm came from. Safe from any
+ * thread; returns -1 if origin is stdin or memory ran out.
+ */
+int ctl_deliver(unsigned long origin, const char * text, int length){
+    ctl_client_t * client;
+    ctl_message_t * message, * head;
+
+    if(origin == 0)
+        return -1;
+    message = malloc(sizeof(ctl_message_t) + length);
+    if(message == NULL)
+        return -1;
+    message->generation = (origin - 1) / CTL_MAX_CLIENTS;
+    message->length = length;
+    memcpy(message->text, text, length);
+
+    client = &ctl_clients[(origin - 1) % CTL_MAX_CLIENTS];
+    head = __atomic_load_n(&client->outbox, __ATOMIC_RELAXED);
+    do
+        message->next = head;
+    while(!__atomic_compare_exchange_n(&client->outbox, &head, message, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    ctl_wake();
+    return 0;
+}
+
+//Write out everything queued for a connection, oldest first.
+static void ctl_flush(ctl_client_t * client){
+    ctl_message_t * message, * reversed = NULL, * next;
+
+    message = __atomic_exchange_n(&client->outbox, NULL, __ATOMIC_ACQUIRE);
+    for(; message != NULL; message = next){
+        next = message->next;
+        message->next = reversed;
+        reversed = message;
+    }
+    for(; reversed != NULL; reversed = next){
+        next = reversed->next;
+        if(client->fd >= 0 && reversed->generation == client->generation)
+            ctl_reply(client, reversed->text, reversed->length);
+        free(reversed);
+    }
+}
+
+//Answer every woken await whose connection is still the one that asked.
+static void ctl_answer(void){
+    unsigned long long count;
+    waiter_t * done, * reversed = NULL, * next;
+    ctl_waiter_t * await;
+    ctl_client_t * client;
+    char reply[64];
+    int length, i;
+
+    if(read(ctl_wake_fd, &count, sizeof(count)) < 0)
+        return;
+    for(i = 0; i < CTL_MAX_CLIENTS; i++)
+        if(__atomic_load_n(&ctl_clients[i].outbox, __ATOMIC_RELAXED) != NULL)
+            ctl_flush(&ctl_clients[i]);
+
+    done = __atomic_exchange_n(&ctl_done, NULL, __ATOMIC_ACQUIRE);
+    //Pushed newest first; answer in the order they were woken
+    for(; done != NULL; done = next){
+        next = done->next;
+        done->next = reversed;
+        reversed = done;
+    }
+
+    for(; reversed != NULL; reversed = next){
+        next = reversed->next;
+        await = (ctl_waiter_t *)reversed;
+        client = &ctl_clients[await->client];
+        if(client->fd >= 0 && client->generation == await->generation){
+            length = snprintf(reply, sizeof(reply), "%s %lu\n",
+                              await_outcome_name(reversed->state), reversed->id);
+            ctl_reply(client, reply, length);
+        }
+        free(await);
+    }
+}
+
+//Park an await for the client, or answer at once if there is nothing to wait for.
+static void ctl_await(ctl_client_t * client, FILE * out, unsigned long id){
+    ctl_waiter_t * await = malloc(sizeof(ctl_waiter_t));
+
+    if(await == NULL){
+        fprintf(out, "unknown %lu\n", id);
+        return;
+    }
+    await->waiter.notify = ctl_notify;
+    await->client = client - ctl_clients;
+    await->generation = client->generation;
+    if(await_watch(id, &await->waiter) == AWAIT_UNKNOWN){
+        fprintf(out, "unknown %lu\n", id);
+        free(await);
+    }
+}
+
+//Answer one query line.
+static void ctl_command(ctl_client_t * client, char * line){
+    char * reply = NULL;
+    size_t length = 0;
+    FILE * out;
+    int seconds;
+    unsigned long id;
+    char message[64];
+
+    out = open_memstream(&reply, &length);
+    if(out == NULL)
+        return;
+
+    if(strcmp(line, "stats") == 0){
+        metrics_stats(out);
+        output_stats(out);
+        batch_stats(out);
+        cgroup_stats(out);
+        pipeline_stats(out);
+    }
+    else if(strncmp(line, "history", 7) == 0){
+        if(sscanf(line, "history %d", &seconds) != 1)
+            seconds = 0;
+        metrics_history(out, seconds);
+    }
+    else if(sscanf(line, "await %lu", &id) == 1)
+        ctl_await(client, out, id);
+    else if(ctl_submit != NULL && sscanf(line, "%d %63[^\n]", &seconds, message) == 2){
+        id = ctl_submit(seconds, message, ctl_origin(client));
+        if(id == 0)
+            fprintf(out, "Alarm not submitted\n");
+        else
+            fprintf(out, "alarm %lu\n", id);
+    }
+    else
+        fprintf(out, "Bad command\n");
+
+    fclose(out);
+    ctl_reply(client, reply, length);
+    free(reply);
+}
+
+//Read what the client sent and run every complete line.
+static void ctl_read(ctl_client_t * client){
+    ssize_t got;
+    char * end;
+    size_t consumed;
+
+    got = read(client->fd, client->line + client->used, CTL_LINE_SIZE - 1 - client->used);
+    if(got <= 0){
+        if(got < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        ctl_close(client);
+        return;
+    }
+    client->used += got;
+    client->line[client->used] = '\0';
+
+    while((end = strchr(client->line, '\n')) != NULL){
+        *end = '\0';
+        if(end > client->line && end[-1] == '\r')
+            end[-1] = '\0';
+        ctl_command(client, client->line);
+        if(client->fd < 0)
+            return;
+        consumed = end + 1 - client->line;
+        client->used -= consumed;
+        memmove(client->line, end + 1, client->used + 1);
+    }
+
+    //A line longer than the buffer is dropped
+    if(client->used == CTL_LINE_SIZE - 1)
+        client->used = 0;
+}
+
+static void * ctl_thread(void * arg){
+    struct pollfd fds[CTL_MAX_CLIENTS + 2];
+    int map[CTL_MAX_CLIENTS + 2];
+    ctl_client_t * client;
+    int i, count, fd;
+
+    metrics_register_thread("control");
+
+    while(1){
+        fds[0].fd = ctl_listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = ctl_wake_fd;
+        fds[1].events = POLLIN;
+        count = 2;
+        for(i = 0; i < CTL_MAX_CLIENTS; i++){
+            if(ctl_clients[i].fd < 0)
+                continue;
+            fds[count].fd = ctl_clients[i].fd;
+            //A client not reading its replies gets no more until it does
+            fds[count].events = ctl_clients[i].backlog_length > CTL_BACKLOG_PAUSE ? 0 : POLLIN;
+            if(ctl_clients[i].backlog_length > 0)
+                fds[count].events |= POLLOUT;
+            map[count++] = i;
+        }
+
+        if(poll(fds, count, -1) < 0){
+            if(errno == EINTR)
+                continue;
+            errno_abort("Poll stats socket");
+        }
+
+        if(fds[1].revents & POLLIN)
+            ctl_answer();
+
+        for(i = 2; i < count; i++){
+            client = &ctl_clients[map[i]];
+            //Closed while answering awaits
+            if(client->fd != fds[i].fd)
+                continue;
+            if(fds[i].revents & POLLOUT)
+                ctl_drain(client);
+            if(client->fd >= 0 && (fds[i].revents & ~POLLOUT) != 0)
+                ctl_read(client);
+        }
+
+        if(fds[0].revents & POLLIN){
+            fd = accept4(ctl_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(fd < 0)
+                continue;
+            for(i = 0; i < CTL_MAX_CLIENTS; i++)
+                if(ctl_clients[i].fd < 0)
+                    break;
+            if(i == CTL_MAX_CLIENTS){
+                close(fd);
+                continue;
+            }
+            ctl_clients[i].fd = fd;
+            ctl_clients[i].used = 0;
+        }
+    }
+    return NULL;
+}
+
+/* Listen on the Unix socket at path, replacing a stale one,
+ * and start the thread serving it. Alarms sent on it go to submit.
+ */
+int ctl_start(const char * path, ctl_submit_t submit){
+    struct sockaddr_un address;
+    pthread_t thread;
+    int i, status;
+
+    if(strlen(path) >= sizeof(address.sun_path))
+        return ENAMETOOLONG;
+
+    ctl_submit = submit;
+    for(i = 0; i < CTL_MAX_CLIENTS; i++)
+        ctl_clients[i].fd = -1;
+
+    ctl_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(ctl_wake_fd < 0)
+        return errno;
+
+    ctl_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(ctl_listen_fd < 0)
+        return errno;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if(bind(ctl_listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0
+       || listen(ctl_listen_fd, CTL_MAX_CLIENTS) != 0){
+        status = errno;
+        close(ctl_listen_fd);
+        return status;
+    }
+
+    status = pthread_create(&thread, NULL, ctl_thread, NULL);
+    if(status != 0)
+        return status;
+    return pthread_detach(thread);
+}
@@ -0,0 +1,23 @@
+#ifndef __ctl_h
+#define __ctl_h
+
+/*
+ * ctl.h
+ *
+ * Stats socket. A Unix domain stream socket served by a single
+ * poll() thread; each line received is a query and is answered on
+ * the same connection. "await <id>" is answered later, when the
+ * alarm fires or is cancelled.
+ *
+ * A line of "<seconds> <message>" submits an alarm, through the
+ * submit hook. The alarm carries its connection as an origin, and
+ * its expiry is delivered to that connection alone by ctl_deliver.
+ */
+
+//Submits an alarm for a connection, returning its id (0 on failure)
+typedef unsigned long (*ctl_submit_t)(int seconds, const char * message, unsigned long origin);
+
+int ctl_start(const char * path, ctl_submit_t submit);
+int ctl_deliver(unsigned long origin, const char * text, int length);
+
+#endif
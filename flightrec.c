@@ -0,0 +1,207 @@
+/*
+ * flightrec.c
+ *
+ * Flight recorder rings. Each ring has exactly one writer, its
+ * owning thread, which fills in the slot and then publishes the new
+ * head, so recording is a clock read and a few stores. Dumping only
+ * uses write(2) and hand rolled number formatting, since it runs
+ * inside signal handlers.
+ */
+#define _GNU_SOURCE
+#include <signal.h>
+#include <time.h>
+#include "errors.h"
+#include "flightrec.h"
+
+#define FR_MAX_THREADS 16
+//Must be a power of two
+#define FR_RING_SIZE 1024
+#define FR_NAME_SIZE 24
+#define FR_LINE_SIZE 160
+
+typedef struct fr_event {
+    unsigned long ts;           /* nanoseconds, CLOCK_MONOTONIC */
+    unsigned int type;
+    unsigned int a;
+    unsigned long b;
+} fr_event_t;
+
+typedef struct fr_ring {
+    char name[FR_NAME_SIZE];
+    volatile unsigned long head;
+    fr_event_t events[FR_RING_SIZE];
+} fr_ring_t;
+
+static fr_ring_t fr_rings[FR_MAX_THREADS];
+static int fr_ring_count = 0;
+static __thread fr_ring_t * fr_self = NULL;
+//Where the signal handlers dump to
+static int fr_fd = 2;
+static volatile sig_atomic_t fr_dumping = 0;
+
+static const char * fr_type_names[] = {
+    "none", "submit", "dispatch", "receive", "fire", "lock_wait", "queue_depth",
+    "backend"
+};
+
+/* Fatal signals: dump, then let the default action run so
+ * the process still dies (and cores) as it would have.
+ */
+static void fr_fatal_handler(int sig){
+    fr_dump(fr_fd, sig == SIGSEGV ? "SIGSEGV" : "SIGABRT");
+    raise(sig);
+}
+
+static void fr_usr2_handler(int sig){
+    fr_dump(fr_fd, "SIGUSR2");
+}
+
+/* Install the dump handlers. Dumps go to fd, stderr by default.
+ */
+int fr_init(int fd){
+    struct sigaction action;
+
+    fr_fd = fd;
+
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = fr_fatal_handler;
+    action.sa_flags = SA_RESETHAND;
+    if(sigaction(SIGABRT, &action, NULL) != 0 || sigaction(SIGSEGV, &action, NULL) != 0)
+        return -1;
+
+    action.sa_handler = fr_usr2_handler;
+    action.sa_flags = SA_RESTART;
+    if(sigaction(SIGUSR2, &action, NULL) != 0)
+        return -1;
+
+    return 0;
+}
+
+//Give the calling thread a ring. Threads without one record nothing.
+void fr_register_thread(const char * name){
+    int slot;
+
+    slot = __atomic_fetch_add(&fr_ring_count, 1, __ATOMIC_ACQ_REL);
+    if(slot >= FR_MAX_THREADS)
+        return;
+    snprintf(fr_rings[slot].name, FR_NAME_SIZE, "%s", name);
+    fr_self = &fr_rings[slot];
+}
+
+void fr_record(int type, unsigned int a, unsigned long b){
+    fr_ring_t * ring = fr_self;
+    fr_event_t * event;
+    struct timespec now;
+    unsigned long head;
+
+    if(ring == NULL)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    head = ring->head;
+    event = &ring->events[head & (FR_RING_SIZE - 1)];
+    event->ts = (unsigned long)now.tv_sec * 1000000000UL + now.tv_nsec;
+    event->type = type;
+    event->a = a;
+    event->b = b;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+//Append a string to the line buffer, async-signal-safe
+static int fr_put_str(char * line, int pos, const char * str){
+    while(*str != '\0' && pos < FR_LINE_SIZE - 1)
+        line[pos++] = *str++;
+    return pos;
+}
+
+//Append an unsigned number, zero padded to width digits
+static int fr_put_ulong(char * line, int pos, unsigned long value, int width){
+    char digits[24];
+    int count = 0;
+
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while(value != 0 && count < (int)sizeof(digits));
+    while(count < width && count < (int)sizeof(digits))
+        digits[count++] = '0';
+    while(count > 0 && pos < FR_LINE_SIZE - 1)
+        line[pos++] = digits[--count];
+    return pos;
+}
+
+static void fr_write(int fd, const char * line, int length){
+    ssize_t written;
+
+    while(length > 0){
+        written = write(fd, line, length);
+        if(written <= 0)
+            return;
+        line += written;
+        length -= written;
+    }
+}
+
+/* Write every ring, oldest event first. Events being recorded while
+ * the dump runs may show up torn; everything older is intact.
+ */
+void fr_dump(int fd, const char * reason){
+    char line[FR_LINE_SIZE];
+    fr_ring_t * ring;
+    fr_event_t * event;
+    unsigned long head, start, i;
+    int r, rings, pos;
+    int saved_errno = errno;
+
+    //A fault while dumping must not dump again
+    if(fr_dumping)
+        return;
+    fr_dumping = 1;
+
+    pos = fr_put_str(line, 0, "=== flight recorder dump (");
+    pos = fr_put_str(line, pos, reason);
+    pos = fr_put_str(line, pos, ") ===\n");
+    fr_write(fd, line, pos);
+
+    rings = __atomic_load_n(&fr_ring_count, __ATOMIC_ACQUIRE);
+    if(rings > FR_MAX_THREADS)
+        rings = FR_MAX_THREADS;
+
+    for(r = 0; r < rings; r++){
+        ring = &fr_rings[r];
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        start = head > FR_RING_SIZE ? head - FR_RING_SIZE : 0;
+
+        for(i = start; i < head; i++){
+            event = &ring->events[i & (FR_RING_SIZE - 1)];
+            pos = fr_put_str(line, 0, ring->name);
+            pos = fr_put_str(line, pos, " ");
+            pos = fr_put_ulong(line, pos, event->ts / 1000000000UL, 1);
+            pos = fr_put_str(line, pos, ".");
+            pos = fr_put_ulong(line, pos, event->ts % 1000000000UL, 9);
+            pos = fr_put_str(line, pos, " ");
+            if(event->type < sizeof(fr_type_names) / sizeof(fr_type_names[0]))
+                pos = fr_put_str(line, pos, fr_type_names[event->type]);
+            else
+                pos = fr_put_str(line, pos, "unknown");
+            pos = fr_put_str(line, pos, " a=");
+            pos = fr_put_ulong(line, pos, event->a, 1);
+            if(event->type == FR_LOCK_WAIT){
+                pos = fr_put_str(line, pos, " lock=");
+                pos = fr_put_str(line, pos, (const char *)event->b);
+            } else {
+                pos = fr_put_str(line, pos, " b=");
+                pos = fr_put_ulong(line, pos, event->b, 1);
+            }
+            line[pos++] = '\n';
+            fr_write(fd, line, pos);
+        }
+    }
+
+    pos = fr_put_str(line, 0, "=== end of flight recorder dump ===\n");
+    fr_write(fd, line, pos);
+
+    fr_dumping = 0;
+    errno = saved_errno;
+}
@@ -0,0 +1,27 @@
+#ifndef __flightrec_h
+#define __flightrec_h
+
+/*
+ * flightrec.h
+ *
+ * Always-on flight recorder. Every registered thread keeps a ring
+ * of its last FR_RING_SIZE events, written without locks. The rings
+ * are dumped by the SIGABRT and SIGSEGV handlers (so an err_abort()
+ * leaves the traffic that led up to it behind) and on SIGUSR2.
+ */
+
+//Event types. a and b are event specific.
+#define FR_SUBMIT 1         /* a = seconds, b = alarm id */
+#define FR_DISPATCH 2       /* a = shard, b = alarm id */
+#define FR_RECEIVE 3        /* a = shard, b = alarm id */
+#define FR_FIRE 4           /* a = lateness in usec, b = alarm id */
+#define FR_LOCK_WAIT 5      /* a = wait in usec, b = lock name */
+#define FR_QUEUE_DEPTH 6    /* a = shard, b = depth */
+#define FR_BACKEND 7        /* a = shard, b = new queue backend */
+
+int fr_init(int fd);
+void fr_register_thread(const char * name);
+void fr_record(int type, unsigned int a, unsigned long b);
+void fr_dump(int fd, const char * reason);
+
+#endif
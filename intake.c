@@ -0,0 +1,53 @@
+/*
+ * intake.c
+ *
+ * Intrusive MPSC queue, see intake.h. A pusher swaps itself in as
+ * the last node and only then links the previous last node to it,
+ * so between those two steps the chain from first is cut short and
+ * the consumer sees an empty queue.
+ */
+#include "errors.h"
+#include "intake.h"
+
+void intake_init(intake_t * intake){
+    intake->stub.link = NULL;
+    intake->last = &intake->stub;
+    intake->first = &intake->stub;
+}
+
+void intake_push(intake_t * intake, alarm_t * alarm){
+    alarm_t * previous;
+
+    alarm->link = NULL;
+    previous = __atomic_exchange_n(&intake->last, alarm, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&previous->link, alarm, __ATOMIC_RELEASE);
+}
+
+//Oldest alarm, or NULL if there is none yet. Consumer only.
+alarm_t * intake_pop(intake_t * intake){
+    alarm_t * first = intake->first;
+    alarm_t * next = __atomic_load_n(&first->link, __ATOMIC_ACQUIRE);
+
+    //Step over the stub
+    if(first == &intake->stub){
+        if(next == NULL)
+            return NULL;
+        intake->first = first = next;
+        next = __atomic_load_n(&first->link, __ATOMIC_ACQUIRE);
+    }
+    if(next != NULL){
+        intake->first = next;
+        return first;
+    }
+
+    //first is the only node, unless a push is halfway
+    if(first != __atomic_load_n(&intake->last, __ATOMIC_ACQUIRE))
+        return NULL;
+    //Put the stub behind it so it can be taken
+    intake_push(intake, &intake->stub);
+    next = __atomic_load_n(&first->link, __ATOMIC_ACQUIRE);
+    if(next == NULL)
+        return NULL;
+    intake->first = next;
+    return first;
+}
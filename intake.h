@@ -0,0 +1,32 @@
+#ifndef __intake_h
+#define __intake_h
+
+#include "alarm.h"
+
+/*
+ * intake.h
+ *
+ * Multi-producer, single-consumer queue of alarms between the
+ * parsers and the alarm thread, linked through the alarms' own link
+ * fields. A push is one atomic exchange, so any number of parser
+ * threads submit without a lock and without waiting on each other,
+ * and alarms come out in the order they went in, which keeps every
+ * input source's alarms in that source's order.
+ *
+ * The queue always holds at least one node, the stub standing in
+ * when it would otherwise be empty. intake_pop can come back empty
+ * for a moment while a push is half done; the consumer just tries
+ * again.
+ */
+
+typedef struct intake {
+    alarm_t * last;         /* pushers swap themselves in here */
+    alarm_t * first;        /* the consumer's end */
+    alarm_t stub;
+} intake_t;
+
+void intake_init(intake_t * intake);
+void intake_push(intake_t * intake, alarm_t * alarm);
+alarm_t * intake_pop(intake_t * intake);
+
+#endif
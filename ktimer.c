@@ -0,0 +1,183 @@
+/*
+ * ktimer.c
+ *
+ * Kernel timer backends, see ktimer.h. Nothing here orders alarms:
+ * arming hands the deadline to the kernel, and waiting collects
+ * whichever timers it has fired since. Fired and cancelled timers
+ * are deleted straight away, so the kernel only ever holds the
+ * alarms still pending.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include "errors.h"
+#include "ktimer.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+//Events taken from epoll per call
+#define KTIMER_BATCH 64
+
+static const char * ktimer_names[] = { "timer_create", "timerfd" };
+
+const char * ktimer_name(int kind){
+    if(kind < KTIMER_POSIX || kind > KTIMER_TIMERFD)
+        return "unknown";
+    return ktimer_names[kind];
+}
+
+/* Set up on the calling thread, which is the one POSIX timers will
+ * signal. Returns 0, or an errno value.
+ */
+int ktimer_init(ktimer_t * kt, int kind){
+    sigset_t mask;
+
+    memset(kt, 0, sizeof(ktimer_t));
+    kt->kind = kind;
+    kt->epfd = -1;
+    kt->tid = syscall(SYS_gettid);
+
+    if(kind == KTIMER_TIMERFD){
+        kt->epfd = epoll_create1(EPOLL_CLOEXEC);
+        return kt->epfd < 0 ? errno : 0;
+    }
+
+    //Signals are only ever taken with sigtimedwait
+    sigemptyset(&mask);
+    sigaddset(&mask, KTIMER_SIGNAL);
+    return pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+void ktimer_destroy(ktimer_t * kt){
+    if(kt->epfd >= 0)
+        close(kt->epfd);
+    kt->epfd = -1;
+}
+
+//Give the kernel its own copy of the entry's deadline
+static int ktimer_set(ktimer_t * kt, ktimer_entry_t * entry){
+    struct sigevent event;
+    struct epoll_event ready;
+    struct itimerspec when;
+
+    memset(&when, 0, sizeof(when));
+    when.it_value = entry->alarm->time;
+    //A zero it_value would disarm instead
+    if(when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0)
+        when.it_value.tv_nsec = 1;
+
+    if(kt->kind == KTIMER_POSIX){
+        memset(&event, 0, sizeof(event));
+        event.sigev_notify = SIGEV_THREAD_ID;
+        event.sigev_signo = KTIMER_SIGNAL;
+        event.sigev_value.sival_ptr = entry;
+        event.sigev_notify_thread_id = kt->tid;
+        if(timer_create(CLOCK_REALTIME, &event, &entry->timer) != 0)
+            return -1;
+        if(timer_settime(entry->timer, TIMER_ABSTIME, &when, NULL) != 0){
+            timer_delete(entry->timer);
+            return -1;
+        }
+        return 0;
+    }
+
+    entry->fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(entry->fd < 0)
+        return -1;
+    ready.events = EPOLLIN;
+    ready.data.ptr = entry;
+    if(timerfd_settime(entry->fd, TFD_TIMER_ABSTIME, &when, NULL) != 0
+       || epoll_ctl(kt->epfd, EPOLL_CTL_ADD, entry->fd, &ready) != 0){
+        close(entry->fd);
+        return -1;
+    }
+    return 0;
+}
+
+//Delete an entry's kernel timer and free it.
+static void ktimer_release(ktimer_t * kt, ktimer_entry_t * entry){
+    //Deleting a POSIX timer also drops its signal if still pending
+    if(kt->kind == KTIMER_POSIX)
+        timer_delete(entry->timer);
+    else
+        close(entry->fd);
+    kt->armed--;
+    free(entry);
+}
+
+/* Arm a kernel timer for alarm. The entry is the handle for
+ * cancelling it; NULL, with errno set, if the kernel refused.
+ */
+ktimer_entry_t * ktimer_arm(ktimer_t * kt, alarm_t * alarm){
+    ktimer_entry_t * entry;
+    int saved;
+
+    entry = calloc(1, sizeof(ktimer_entry_t));
+    if(entry == NULL)
+        return NULL;
+    entry->alarm = alarm;
+    if(ktimer_set(kt, entry) != 0){
+        saved = errno;
+        free(entry);
+        errno = saved;
+        return NULL;
+    }
+    kt->armed++;
+    return entry;
+}
+
+void ktimer_cancel(ktimer_t * kt, ktimer_entry_t * entry){
+    ktimer_release(kt, entry);
+}
+
+/* Wait up to timeout_ms (-1 for ever) for a timer to fire, then
+ * store up to max fired alarms into fired without waiting further.
+ * Returns how many were stored.
+ */
+int ktimer_wait(ktimer_t * kt, alarm_t ** fired, int max, int timeout_ms){
+    struct epoll_event ready[KTIMER_BATCH];
+    struct timespec timeout;
+    unsigned long long expirations;
+    ktimer_entry_t * entry;
+    sigset_t mask;
+    siginfo_t info;
+    int found = 0, count, i;
+
+    if(kt->kind == KTIMER_TIMERFD){
+        count = epoll_wait(kt->epfd, ready, max < KTIMER_BATCH ? max : KTIMER_BATCH, timeout_ms);
+        for(i = 0; i < count; i++){
+            entry = ready[i].data.ptr;
+            if(read(entry->fd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN)
+                continue;
+            fired[found++] = entry->alarm;
+            ktimer_release(kt, entry);
+        }
+        return found;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, KTIMER_SIGNAL);
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    while(found < max){
+        if(timeout_ms < 0)
+            i = sigwaitinfo(&mask, &info);
+        else
+            i = sigtimedwait(&mask, &info, &timeout);
+        if(i < 0)
+            break;
+        entry = info.si_value.sival_ptr;
+        fired[found++] = entry->alarm;
+        ktimer_release(kt, entry);
+        //Only the first signal is waited for
+        timeout_ms = 0;
+        timeout.tv_sec = timeout.tv_nsec = 0;
+    }
+    return found;
+}
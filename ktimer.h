@@ -0,0 +1,51 @@
+#ifndef __ktimer_h
+#define __ktimer_h
+
+#include <signal.h>
+#include <sys/types.h>
+#include "alarm.h"
+
+/*
+ * ktimer.h
+ *
+ * Kernel timer backends, for comparing the shard queues against
+ * leaving the ordering to the kernel. Every armed alarm costs one
+ * kernel timer:
+ *
+ *   KTIMER_POSIX     a timer_create timer signalling the thread that
+ *                    called ktimer_init (SIGEV_THREAD_ID), collected
+ *                    with sigtimedwait
+ *   KTIMER_TIMERFD   a timerfd, all of them under one epoll
+ *
+ * POSIX timers count against RLIMIT_SIGPENDING and timerfds against
+ * RLIMIT_NOFILE; ktimer_arm returns NULL with errno set at the limit.
+ * Deadlines are the alarms' absolute CLOCK_REALTIME times.
+ *
+ * A ktimer is not locked; only the thread that created it may use it.
+ */
+
+#define KTIMER_POSIX 0
+#define KTIMER_TIMERFD 1
+#define KTIMER_SIGNAL SIGRTMIN
+
+typedef struct ktimer_entry {
+    alarm_t * alarm;
+    timer_t timer;
+    int fd;
+} ktimer_entry_t;
+
+typedef struct ktimer {
+    int kind;
+    int epfd;
+    pid_t tid;
+    int armed;
+} ktimer_t;
+
+int ktimer_init(ktimer_t * kt, int kind);
+void ktimer_destroy(ktimer_t * kt);
+const char * ktimer_name(int kind);
+ktimer_entry_t * ktimer_arm(ktimer_t * kt, alarm_t * alarm);
+void ktimer_cancel(ktimer_t * kt, ktimer_entry_t * entry);
+int ktimer_wait(ktimer_t * kt, alarm_t ** fired, int max, int timeout_ms);
+
+#endif
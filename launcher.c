@@ -0,0 +1,307 @@
+/*
+ * launcher.c
+ *
+ * Expiry action launcher, see launcher.h. The helper process talks
+ * to this one over two pipes of fixed-size records, requests one way
+ * and results the other. Each request is a command with the id of
+ * the alarm it belongs to; each result is that id with the pid and
+ * wait status, or the errno if the command couldn't be spawned.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include "errors.h"
+#include "launcher.h"
+#include "metrics.h"
+
+typedef struct launcher_request {
+    unsigned long id;
+    char command[LAUNCHER_COMMAND_SIZE];
+} launcher_request_t;
+
+typedef struct launcher_result {
+    unsigned long id;
+    int pid;
+    int status;             /* wait status, if pid > 0 */
+    int error;              /* spawn errno, if pid == 0 */
+} launcher_result_t;
+
+//Helper side: a request waiting for a free slot, or a running command
+typedef struct launcher_job {
+    struct launcher_job * next;
+    launcher_request_t request;
+    pid_t pid;
+} launcher_job_t;
+
+extern char ** environ;
+
+static int launcher_request_fd = -1;
+static int launcher_result_fd = -1;
+static int launcher_wake_fd = -1;
+//Fired alarms not yet sent to the helper, newest first
+static alarm_t * launcher_pending = NULL;
+
+//Read exactly size bytes, or fail at end of file.
+static int launcher_read(int fd, void * buffer, size_t size){
+    ssize_t got;
+    size_t done = 0;
+
+    while(done < size){
+        got = read(fd, (char *)buffer + done, size - done);
+        if(got < 0 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            return -1;
+        done += got;
+    }
+    return 0;
+}
+
+static int launcher_write(int fd, const void * buffer, size_t size){
+    ssize_t written;
+    size_t done = 0;
+
+    while(done < size){
+        written = write(fd, (const char *)buffer + done, size - done);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            return -1;
+        done += written;
+    }
+    return 0;
+}
+
+//Helper: spawn a job, or report straight away why it couldn't be.
+static int launcher_spawn(launcher_job_t * job, int results){
+    launcher_result_t result;
+    char * argv[] = { "/bin/sh", "-c", job->request.command, NULL };
+    posix_spawnattr_t attributes;
+    sigset_t none;
+    int status;
+
+    //Commands shouldn't inherit the helper's blocked SIGCHLD
+    sigemptyset(&none);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigmask(&attributes, &none);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+    status = posix_spawn(&job->pid, "/bin/sh", NULL, &attributes, argv, environ);
+    posix_spawnattr_destroy(&attributes);
+    if(status == 0)
+        return 0;
+
+    memset(&result, 0, sizeof(result));
+    result.id = job->request.id;
+    result.error = status;
+    launcher_write(results, &result, sizeof(result));
+    return -1;
+}
+
+/* The helper process. Single threaded: polls the request pipe and a
+ * signalfd for SIGCHLD, and exits once My_Alarm closes the pipe.
+ */
+static void launcher_helper(int requests, int results, int limit){
+    launcher_job_t * waiting = NULL, ** waiting_tail = &waiting;
+    launcher_job_t * running = NULL, ** link, * job;
+    launcher_result_t result;
+    struct signalfd_siginfo info;
+    struct pollfd fds[2];
+    sigset_t mask;
+    pid_t pid;
+    int status, count = 0, open = 1;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    fds[0].fd = requests;
+    fds[0].events = POLLIN;
+    fds[1].fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    fds[1].events = POLLIN;
+    if(fds[1].fd < 0)
+        _exit(EXIT_FAILURE);
+
+    while(open || running != NULL){
+        //Only read more requests while there is room to run them
+        fds[0].fd = open && waiting == NULL ? requests : -1;
+        if(poll(fds, 2, -1) < 0 && errno != EINTR)
+            _exit(EXIT_FAILURE);
+
+        if(fds[0].revents != 0){
+            job = malloc(sizeof(launcher_job_t));
+            if(job == NULL || launcher_read(requests, &job->request, sizeof(job->request)) != 0){
+                free(job);
+                open = 0;
+            } else {
+                job->next = NULL;
+                *waiting_tail = job;
+                waiting_tail = &job->next;
+            }
+        }
+
+        if(fds[1].revents != 0){
+            if(read(fds[1].fd, &info, sizeof(info)) < 0 && errno != EAGAIN)
+                _exit(EXIT_FAILURE);
+            while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+                for(link = &running; *link != NULL && (*link)->pid != pid; link = &(*link)->next);
+                if(*link == NULL)
+                    continue;
+                job = *link;
+                *link = job->next;
+                count--;
+                memset(&result, 0, sizeof(result));
+                result.id = job->request.id;
+                result.pid = pid;
+                result.status = status;
+                launcher_write(results, &result, sizeof(result));
+                free(job);
+            }
+        }
+
+        //Start whatever fits under the limit, oldest first
+        while(waiting != NULL && count < limit){
+            job = waiting;
+            waiting = job->next;
+            if(waiting == NULL)
+                waiting_tail = &waiting;
+            if(launcher_spawn(job, results) != 0){
+                free(job);
+                continue;
+            }
+            job->next = running;
+            running = job;
+            count++;
+        }
+    }
+    _exit(0);
+}
+
+//Hand every pending alarm's command to the helper, in the order they fired.
+static void launcher_feed(void){
+    unsigned long long count;
+    alarm_t * alarm, * reversed = NULL, * next;
+    launcher_request_t request;
+
+    if(read(launcher_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return;
+    alarm = __atomic_exchange_n(&launcher_pending, NULL, __ATOMIC_ACQUIRE);
+    for(; alarm != NULL; alarm = next){
+        next = alarm->link;
+        alarm->link = reversed;
+        reversed = alarm;
+    }
+
+    for(alarm = reversed; alarm != NULL; alarm = next){
+        next = alarm->link;
+        memset(&request, 0, sizeof(request));
+        request.id = alarm->id;
+        snprintf(request.command, LAUNCHER_COMMAND_SIZE, "%s", alarm->message);
+        if(launcher_write(launcher_request_fd, &request, sizeof(request)) != 0)
+            fprintf(stderr, "Launcher: lost command for alarm %lu\n", alarm->id);
+        free(alarm);
+    }
+}
+
+static void launcher_report(void){
+    launcher_result_t result;
+
+    if(launcher_read(launcher_result_fd, &result, sizeof(result)) != 0)
+        err_abort(EPIPE, "Launcher helper exited");
+
+    flockfile(stdout);
+    if(result.pid == 0)
+        printf("\nLauncher: alarm %lu command not started: %s\n", result.id, strerror(result.error));
+    else if(WIFEXITED(result.status))
+        printf("\nLauncher: alarm %lu command (pid %d) exited with status %d\n",
+               result.id, result.pid, WEXITSTATUS(result.status));
+    else
+        printf("\nLauncher: alarm %lu command (pid %d) killed by signal %d\n",
+               result.id, result.pid, WTERMSIG(result.status));
+    fflush(stdout);
+    funlockfile(stdout);
+}
+
+static void * launcher_thread(void * arg){
+    struct pollfd fds[2];
+
+    metrics_register_thread("launcher");
+    fds[0].fd = launcher_wake_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = launcher_result_fd;
+    fds[1].events = POLLIN;
+
+    while(1){
+        if(poll(fds, 2, -1) < 0){
+            if(errno == EINTR)
+                continue;
+            errno_abort("Poll launcher");
+        }
+        if(fds[0].revents != 0)
+            launcher_feed();
+        if(fds[1].revents != 0)
+            launcher_report();
+    }
+    return NULL;
+}
+
+/* Fork the helper, allowing limit commands to run at once, and start
+ * the thread that talks to it. Call before any other thread exists.
+ */
+int launcher_start(int limit){
+    int requests[2], results[2];
+    pthread_t thread;
+    pid_t pid;
+    int status;
+
+    if(limit < 1)
+        return EINVAL;
+    if(pipe2(requests, O_CLOEXEC) != 0 || pipe2(results, O_CLOEXEC) != 0)
+        return errno;
+
+    pid = fork();
+    if(pid < 0)
+        return errno;
+    if(pid == 0){
+        close(requests[1]);
+        close(results[0]);
+        launcher_helper(requests[0], results[1], limit);
+    }
+
+    close(requests[0]);
+    close(results[1]);
+    launcher_request_fd = requests[1];
+    launcher_result_fd = results[0];
+    launcher_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(launcher_wake_fd < 0)
+        return errno;
+
+    status = pthread_create(&thread, NULL, launcher_thread, NULL);
+    if(status != 0)
+        return status;
+    return pthread_detach(thread);
+}
+
+int launcher_started(void){
+    return launcher_wake_fd >= 0;
+}
+
+/* Run a fired alarm's message as a command. Takes the alarm, which
+ * the launcher thread frees once the command is on its way.
+ */
+void launcher_run(alarm_t * alarm){
+    unsigned long long one = 1;
+    alarm_t * head = __atomic_load_n(&launcher_pending, __ATOMIC_RELAXED);
+
+    do
+        alarm->link = head;
+    while(!__atomic_compare_exchange_n(&launcher_pending, &head, alarm, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    //Only the first of a batch needs to wake the launcher thread
+    if(head == NULL && write(launcher_wake_fd, &one, sizeof(one)) < 0)
+        return;
+}
@@ -0,0 +1,27 @@
+#ifndef __launcher_h
+#define __launcher_h
+
+#include "alarm.h"
+
+/*
+ * launcher.h
+ *
+ * Expiry actions. Commands are run by a helper process forked at
+ * startup, while My_Alarm is still single threaded, so nothing ever
+ * forks the big multithreaded process. The helper posix_spawns each
+ * command with /bin/sh -c, holds back any beyond the concurrency
+ * limit in arrival order, and reports every exit status back.
+ *
+ * A display thread hands over a fired alarm with launcher_run, which
+ * is a compare-and-swap onto a lock-free list, plus an eventfd write
+ * when the list was empty. A launcher thread in this process feeds
+ * the helper and prints the exit statuses as they come back.
+ */
+
+#define LAUNCHER_COMMAND_SIZE 64
+
+int launcher_start(int limit);
+int launcher_started(void);
+void launcher_run(alarm_t * alarm);
+
+#endif
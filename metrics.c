@@ -0,0 +1,289 @@
+/*
+ * metrics.c
+ *
+ * Metrics history. Counters for the current second are bumped with
+ * atomic adds from whichever thread sees the event, and exchanged
+ * back to zero once a second by the sampler thread, which also reads
+ * the shard queue depths and the CPU clock of every registered thread.
+ * The resulting snapshot goes into a ring that only the sampler
+ * writes, so queries never block the hot threads.
+ */
+#include <pthread.h>
+#include <time.h>
+#include "errors.h"
+#include "metrics.h"
+
+//Lateness histogram: bucket 0 is under 1 usec, bucket i is under 2^i usec
+#define METRICS_BUCKETS 32
+#define METRICS_NAME_SIZE 24
+
+typedef struct metrics_snapshot {
+    time_t when;
+    unsigned int submitted;
+    unsigned int expired;
+    unsigned int p99_usec;
+    unsigned int depth[METRICS_MAX_SHARDS];
+    unsigned short cpu[METRICS_MAX_THREADS];    /* permille of one CPU */
+} metrics_snapshot_t;
+
+typedef struct metrics_thread_info {
+    char name[METRICS_NAME_SIZE];
+    clockid_t clock;
+    unsigned long long last_ns;
+    int ready;                  /* set once the rest is filled in */
+} metrics_thread_info_t;
+
+//Counters for the second in progress
+static unsigned int current_submitted = 0;
+static unsigned int current_expired = 0;
+static unsigned int current_lateness[METRICS_BUCKETS];
+
+//Registered shards and threads
+static int * shard_depth[METRICS_MAX_SHARDS];
+static metrics_thread_info_t threads[METRICS_MAX_THREADS];
+static int thread_count = 0;
+
+//History, written only by the sampler
+static metrics_snapshot_t history[METRICS_HISTORY];
+static unsigned long history_count = 0;
+static unsigned long total_submitted = 0;
+static unsigned long total_expired = 0;
+//Shard wakeups delivered and suppressed, totals only
+static unsigned long total_woken = 0;
+static unsigned long total_suppressed = 0;
+//Spread alarms fired, how far into their windows, and how many past them
+static unsigned long spread_fired = 0;
+static unsigned long spread_past = 0;
+static unsigned long spread_peak_permille = 0;
+static time_t started;
+
+static unsigned long long metrics_clock_ns(clockid_t clock){
+    struct timespec now;
+
+    if(clock_gettime(clock, &now) != 0)
+        return 0;
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//Let the sampler report the calling thread's CPU use under name.
+void metrics_register_thread(const char * name){
+    metrics_thread_info_t * info;
+    char * space;
+    int slot;
+
+    slot = __atomic_fetch_add(&thread_count, 1, __ATOMIC_ACQ_REL);
+    if(slot >= METRICS_MAX_THREADS)
+        return;
+
+    info = &threads[slot];
+    snprintf(info->name, METRICS_NAME_SIZE, "%s", name);
+    //Names are history column headers
+    for(space = info->name; (space = strchr(space, ' ')) != NULL; space++)
+        *space = '_';
+    if(pthread_getcpuclockid(pthread_self(), &info->clock) != 0)
+        info->clock = CLOCK_THREAD_CPUTIME_ID;
+    info->last_ns = metrics_clock_ns(info->clock);
+    //The slot is counted before it is filled in, so readers wait for this
+    __atomic_store_n(&info->ready, 1, __ATOMIC_RELEASE);
+}
+
+//Threads to report: the registered ones up to the first not filled in yet
+static int metrics_threads_ready(void){
+    int count, i;
+
+    count = __atomic_load_n(&thread_count, __ATOMIC_ACQUIRE);
+    if(count > METRICS_MAX_THREADS)
+        count = METRICS_MAX_THREADS;
+    for(i = 0; i < count && __atomic_load_n(&threads[i].ready, __ATOMIC_ACQUIRE); i++)
+        ;
+    return i;
+}
+
+//Sample *depth as the queue depth of shard every second.
+void metrics_register_shard(int shard, int * depth){
+    if(shard < 0 || shard >= METRICS_MAX_SHARDS)
+        return;
+    __atomic_store_n(&shard_depth[shard], depth, __ATOMIC_RELEASE);
+}
+
+//An insert that had to wake its display thread, or one that didn't.
+void metrics_wakeup(int delivered){
+    __atomic_add_fetch(delivered ? &total_woken : &total_suppressed, 1, __ATOMIC_RELAXED);
+}
+
+//A spread alarm fired late_usec after its deadline, allowed window_usec.
+void metrics_spread(long late_usec, long window_usec){
+    unsigned long permille, peak;
+
+    __atomic_add_fetch(&spread_fired, 1, __ATOMIC_RELAXED);
+    if(late_usec > window_usec)
+        __atomic_add_fetch(&spread_past, 1, __ATOMIC_RELAXED);
+    permille = late_usec <= 0 ? 0 : (unsigned long)(late_usec * 1000LL / window_usec);
+    peak = __atomic_load_n(&spread_peak_permille, __ATOMIC_RELAXED);
+    while(permille > peak
+          && !__atomic_compare_exchange_n(&spread_peak_permille, &peak, permille, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void metrics_submit(void){
+    __atomic_add_fetch(&current_submitted, 1, __ATOMIC_RELAXED);
+}
+
+void metrics_expire(long lateness_usec){
+    int bucket = 0;
+
+    while(lateness_usec > 0 && bucket < METRICS_BUCKETS - 1){
+        lateness_usec >>= 1;
+        bucket++;
+    }
+    __atomic_add_fetch(&current_expired, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&current_lateness[bucket], 1, __ATOMIC_RELAXED);
+}
+
+//Fold the current second into the history ring.
+static void metrics_sample(void){
+    metrics_snapshot_t * snapshot;
+    unsigned int buckets[METRICS_BUCKETS];
+    unsigned long long now_ns;
+    unsigned int total = 0, seen = 0;
+    int * depth;
+    int i, count;
+
+    snapshot = &history[history_count % METRICS_HISTORY];
+    memset(snapshot, 0, sizeof(metrics_snapshot_t));
+    snapshot->when = time(NULL);
+    snapshot->submitted = __atomic_exchange_n(&current_submitted, 0, __ATOMIC_RELAXED);
+    snapshot->expired = __atomic_exchange_n(&current_expired, 0, __ATOMIC_RELAXED);
+
+    for(i = 0; i < METRICS_BUCKETS; i++){
+        buckets[i] = __atomic_exchange_n(&current_lateness[i], 0, __ATOMIC_RELAXED);
+        total += buckets[i];
+    }
+    //p99 is reported as the upper bound of the bucket it falls in
+    for(i = 0; i < METRICS_BUCKETS && total > 0; i++){
+        seen += buckets[i];
+        if(seen * 100ULL >= total * 99ULL){
+            snapshot->p99_usec = i == 0 ? 0 : 1U << i;
+            break;
+        }
+    }
+
+    for(i = 0; i < METRICS_MAX_SHARDS; i++){
+        depth = __atomic_load_n(&shard_depth[i], __ATOMIC_ACQUIRE);
+        if(depth != NULL)
+            snapshot->depth[i] = __atomic_load_n(depth, __ATOMIC_RELAXED);
+    }
+
+    count = __atomic_load_n(&thread_count, __ATOMIC_ACQUIRE);
+    if(count > METRICS_MAX_THREADS)
+        count = METRICS_MAX_THREADS;
+    for(i = 0; i < count; i++){
+        if(!__atomic_load_n(&threads[i].ready, __ATOMIC_ACQUIRE))
+            continue;
+        now_ns = metrics_clock_ns(threads[i].clock);
+        snapshot->cpu[i] = (now_ns - threads[i].last_ns) / 1000000ULL;
+        threads[i].last_ns = now_ns;
+    }
+
+    total_submitted += snapshot->submitted;
+    total_expired += snapshot->expired;
+    __atomic_store_n(&history_count, history_count + 1, __ATOMIC_RELEASE);
+}
+
+static void * metrics_thread(void * arg){
+    struct timespec next;
+
+    metrics_register_thread("metrics");
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while(1){
+        next.tv_sec += 1;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0);
+        metrics_sample();
+    }
+    return NULL;
+}
+
+int metrics_start(void){
+    pthread_t thread;
+    int status;
+
+    started = time(NULL);
+    status = pthread_create(&thread, NULL, metrics_thread, NULL);
+    if(status != 0)
+        return status;
+    return pthread_detach(thread);
+}
+
+//Totals, and the most recent complete second.
+void metrics_stats(FILE * out){
+    metrics_snapshot_t * last;
+    unsigned long count;
+    int i, registered;
+
+    count = __atomic_load_n(&history_count, __ATOMIC_ACQUIRE);
+    fprintf(out, "Uptime %lds: submitted %lu expired %lu\n",
+            (long)(time(NULL) - started), total_submitted, total_expired);
+    fprintf(out, "Shard wakeups: delivered %lu suppressed %lu\n",
+            __atomic_load_n(&total_woken, __ATOMIC_RELAXED),
+            __atomic_load_n(&total_suppressed, __ATOMIC_RELAXED));
+    if(spread_fired > 0)
+        fprintf(out, "Spread: %lu fired, up to %.1f%% into their windows, %lu past them\n",
+                __atomic_load_n(&spread_fired, __ATOMIC_RELAXED),
+                __atomic_load_n(&spread_peak_permille, __ATOMIC_RELAXED) / 10.0,
+                __atomic_load_n(&spread_past, __ATOMIC_RELAXED));
+    if(count == 0)
+        return;
+
+    last = &history[(count - 1) % METRICS_HISTORY];
+    fprintf(out, "Last second: submitted %u expired %u p99 lateness %uus\n",
+            last->submitted, last->expired, last->p99_usec);
+    for(i = 0; i < METRICS_MAX_SHARDS; i++)
+        if(__atomic_load_n(&shard_depth[i], __ATOMIC_ACQUIRE) != NULL)
+            fprintf(out, "Shard %d queue depth %u\n", i, last->depth[i]);
+
+    registered = metrics_threads_ready();
+    for(i = 0; i < registered; i++)
+        fprintf(out, "Thread %s cpu %.1f%%\n", threads[i].name, last->cpu[i] / 10.0);
+}
+
+/* One line per second for the last seconds seconds, oldest first.
+ * The sampler may overwrite the oldest line while it is being
+ * printed, which is harmless at a one hour depth.
+ */
+void metrics_history(FILE * out, int seconds){
+    metrics_snapshot_t * snapshot;
+    struct tm local_time;
+    char when[16];
+    unsigned long count, first, i;
+    int shard, thread, registered;
+
+    count = __atomic_load_n(&history_count, __ATOMIC_ACQUIRE);
+    if(seconds <= 0 || seconds > METRICS_HISTORY)
+        seconds = METRICS_HISTORY;
+    first = count > (unsigned long)seconds ? count - seconds : 0;
+
+    registered = metrics_threads_ready();
+
+    fprintf(out, "time     submit expire p99_us");
+    for(shard = 0; shard < METRICS_MAX_SHARDS; shard++)
+        if(__atomic_load_n(&shard_depth[shard], __ATOMIC_ACQUIRE) != NULL)
+            fprintf(out, " depth%d", shard);
+    for(thread = 0; thread < registered; thread++)
+        fprintf(out, " %s%%", threads[thread].name);
+    fprintf(out, "\n");
+
+    for(i = first; i < count; i++){
+        snapshot = &history[i % METRICS_HISTORY];
+        localtime_r(&snapshot->when, &local_time);
+        strftime(when, sizeof(when), "%H:%M:%S", &local_time);
+        fprintf(out, "%s %6u %6u %6u", when, snapshot->submitted,
+                snapshot->expired, snapshot->p99_usec);
+        for(shard = 0; shard < METRICS_MAX_SHARDS; shard++)
+            if(__atomic_load_n(&shard_depth[shard], __ATOMIC_ACQUIRE) != NULL)
+                fprintf(out, " %6u", snapshot->depth[shard]);
+        for(thread = 0; thread < registered; thread++)
+            fprintf(out, " %.1f", snapshot->cpu[thread] / 10.0);
+        fprintf(out, "\n");
+    }
+}
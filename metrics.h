@@ -0,0 +1,28 @@
+#ifndef __metrics_h
+#define __metrics_h
+
+#include <stdio.h>
+
+/*
+ * metrics.h
+ *
+ * Per-second metrics history. The hot threads only do atomic adds
+ * on the counters of the current second; a sampler thread folds them
+ * into a fixed ring holding the last METRICS_HISTORY seconds.
+ */
+
+#define METRICS_HISTORY 3600
+#define METRICS_MAX_SHARDS 8
+#define METRICS_MAX_THREADS 16
+
+int metrics_start(void);
+void metrics_register_thread(const char * name);
+void metrics_register_shard(int shard, int * depth);
+void metrics_submit(void);
+void metrics_expire(long lateness_usec);
+void metrics_wakeup(int delivered);
+void metrics_spread(long late_usec, long window_usec);
+void metrics_stats(FILE * out);
+void metrics_history(FILE * out, int seconds);
+
+#endif
@@ -0,0 +1,556 @@
+/*
+ * output.c
+ *
+ * Stdout writer, see output.h. The backlog is the ring followed by
+ * the spill file: while anything is spilled, new output is appended
+ * to the spill too, so the ring always holds the oldest bytes and
+ * draining the ring then the spill keeps everything in order. The
+ * spill file is truncated whenever it empties.
+ *
+ * Writers only ever add at the tail, so the output thread can write
+ * or compress straight out of the ring without the lock and only
+ * takes it again to move the head.
+ *
+ * Compressed output is one gzip stream, sync flushed whenever the
+ * backlog has been empty for OUTPUT_FLUSH_MS, so whatever has been
+ * written so far always decompresses (zcat) up to the last flush.
+ * Each sink segment is a gzip stream of its own.
+ *
+ * Segments are rotated between lines. Space is reserved with
+ * FALLOC_FL_KEEP_SIZE, so a segment's size is always what has been
+ * written, and whatever was reserved but not used is given back by
+ * truncating it when it is closed.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include <zlib.h>
+#include "errors.h"
+#include "output.h"
+#include "metrics.h"
+
+//Bytes moved from the spill file, or out of the compressor, at once
+#define OUTPUT_CHUNK 65536
+
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_backlogged = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t output_finished = PTHREAD_COND_INITIALIZER;
+static int output_fd = 1;                       /* fd 1, or our own open of what it points at */
+static int output_flags = -1;                   /* fd 1's flags to put back, if we changed them */
+static const char * output_spill_path;
+static int output_closing, output_closed;
+
+//Overflow ring
+static char * output_memory;
+static size_t output_head, output_used;
+
+//Spill file, created on first use
+static int output_spill_fd = -1;
+static off_t output_spill_read, output_spill_write;
+
+//Compressor, output thread only
+static int output_level;
+static z_stream output_zip;
+static int output_unflushed;
+
+//File sink. The current segment is output_fd, the sink thread prepares the next.
+static pthread_mutex_t sink_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sink_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sink_wanted = PTHREAD_COND_INITIALIZER;
+static const char * sink_path;
+static long long sink_size;                     /* rotate after this many bytes, 0 for never */
+static int sink_period;                         /* rotate after this many seconds, 0 for never */
+static int sink_segments;                       /* reuse this many segment files, 0 for no limit */
+static unsigned long sink_sequence;             /* segment being written */
+static off_t sink_written;                      /* bytes in it */
+static time_t sink_opened;
+static int sink_next_fd, sink_next_ready;       /* next segment, -1 if it could not be opened */
+static unsigned long sink_rotations, sink_failures;
+
+//Write latency, output thread only
+static unsigned long long output_latency[OUTPUT_BUCKETS];
+static unsigned long long output_latency_max;
+
+//Totals
+static unsigned long long output_accepted, output_written, output_spilled, output_lost;
+static size_t output_memory_peak;
+static off_t output_spill_peak;
+
+static int output_backlog(void){
+    return output_used > 0 || output_spill_write > output_spill_read;
+}
+
+static int output_open_spill(void){
+    char path[] = "/tmp/My_Alarm.spill.XXXXXX";
+
+    if(output_spill_path != NULL)
+        output_spill_fd = open(output_spill_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    else if((output_spill_fd = mkostemp(path, O_CLOEXEC)) >= 0)
+        unlink(path);
+    return output_spill_fd < 0 ? -1 : 0;
+}
+
+//Add to the end of the backlog. Called with output_lock held.
+static void output_append(const char * buffer, size_t size){
+    size_t tail, room, part;
+    ssize_t written;
+
+    output_accepted += size;
+
+    //Into the ring while nothing is spilled and it has room
+    if(output_spill_write == output_spill_read){
+        room = OUTPUT_MEMORY - output_used;
+        part = size < room ? size : room;
+        while(part > 0){
+            tail = (output_head + output_used) % OUTPUT_MEMORY;
+            room = OUTPUT_MEMORY - tail < part ? OUTPUT_MEMORY - tail : part;
+            memcpy(output_memory + tail, buffer, room);
+            output_used += room;
+            buffer += room;
+            size -= room;
+            part -= room;
+        }
+        if(output_used > output_memory_peak)
+            output_memory_peak = output_used;
+    }
+    if(size == 0)
+        return;
+
+    if(output_spill_fd < 0 && output_open_spill() != 0){
+        output_lost += size;
+        return;
+    }
+    while(size > 0){
+        written = pwrite(output_spill_fd, buffer, size, output_spill_write);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0){
+            output_lost += size;
+            return;
+        }
+        output_spill_write += written;
+        output_spilled += written;
+        buffer += written;
+        size -= written;
+    }
+    if(output_spill_write - output_spill_read > output_spill_peak)
+        output_spill_peak = output_spill_write - output_spill_read;
+}
+
+/* Point at the oldest piece of the backlog: in the ring, or read from
+ * the spill file into chunk. Called with output_lock held. Returns
+ * its length, 0 if there is no backlog.
+ */
+static size_t output_next(char * chunk, const char ** piece){
+    size_t part;
+    ssize_t got;
+
+    if(output_used > 0){
+        *piece = output_memory + output_head;
+        return OUTPUT_MEMORY - output_head < output_used ? OUTPUT_MEMORY - output_head : output_used;
+    }
+    while(output_spill_write > output_spill_read){
+        part = output_spill_write - output_spill_read < OUTPUT_CHUNK
+               ? output_spill_write - output_spill_read : OUTPUT_CHUNK;
+        got = pread(output_spill_fd, chunk, part, output_spill_read);
+        if(got < 0 && errno == EINTR)
+            continue;
+        if(got <= 0){
+            output_lost += output_spill_write - output_spill_read;
+            output_spill_read = output_spill_write;
+            break;
+        }
+        *piece = chunk;
+        return got;
+    }
+    return 0;
+}
+
+//Drop size bytes from the front of the backlog. Called with output_lock held.
+static void output_consume(size_t size){
+    if(output_used > 0){
+        output_head = (output_head + size) % OUTPUT_MEMORY;
+        output_used -= size;
+        return;
+    }
+    output_spill_read += size;
+    //Caught up: start the spill file over
+    if(output_spill_read == output_spill_write && ftruncate(output_spill_fd, 0) == 0)
+        output_spill_read = output_spill_write = 0;
+}
+
+//Write all of buffer, waiting for the reader as long as it takes.
+static void output_write(const char * buffer, size_t size){
+    struct pollfd ready = { output_fd, POLLOUT, 0 };
+    struct timespec start, end;
+    unsigned long long usec;
+    ssize_t written;
+    int bucket;
+
+    while(size > 0){
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        written = write(output_fd, buffer, size);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        usec = (end.tv_sec - start.tv_sec) * 1000000ULL + end.tv_nsec / 1000 - start.tv_nsec / 1000;
+        for(bucket = 0; usec >> bucket > 0 && bucket < OUTPUT_BUCKETS - 1; bucket++)
+            ;
+        __atomic_add_fetch(&output_latency[bucket], 1, __ATOMIC_RELAXED);
+        if(usec > output_latency_max)
+            __atomic_store_n(&output_latency_max, usec, __ATOMIC_RELAXED);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written < 0 && errno == EAGAIN){
+            poll(&ready, 1, -1);
+            continue;
+        }
+        if(written < 0){
+            //Nobody to write to: drop it rather than keep it forever
+            __atomic_add_fetch(&output_lost, size, __ATOMIC_RELAXED);
+            return;
+        }
+        __atomic_add_fetch(&output_written, written, __ATOMIC_RELAXED);
+        sink_written += written;
+        buffer += written;
+        size -= written;
+    }
+}
+
+//Compress size bytes (none to just flush) and write what comes out.
+static void output_deflate(const char * buffer, size_t size, int flush){
+    char out[OUTPUT_CHUNK];
+
+    output_zip.next_in = (Bytef *)buffer;
+    output_zip.avail_in = size;
+    do {
+        output_zip.next_out = (Bytef *)out;
+        output_zip.avail_out = sizeof(out);
+        deflate(&output_zip, flush);
+        output_write(out, sizeof(out) - output_zip.avail_out);
+    } while(output_zip.avail_out == 0);
+    output_unflushed = flush == Z_NO_FLUSH;
+}
+
+static void sink_name(unsigned long sequence, char * path, size_t size){
+    snprintf(path, size, "%s.%lu", sink_path, sink_segments > 0 ? sequence % sink_segments : sequence);
+}
+
+//Open segment sequence and reserve its space.
+static int sink_open(unsigned long sequence){
+    char path[PATH_MAX];
+    int fd;
+
+    sink_name(sequence, path, sizeof(path));
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return -1;
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, sink_size > 0 ? sink_size : OUTPUT_PREALLOCATE) != 0)
+        __atomic_add_fetch(&sink_failures, 1, __ATOMIC_RELAXED);
+    return fd;
+}
+
+//Keep the next segment open and allocated, ready for the output thread.
+static void * sink_thread(void * arg){
+    unsigned long sequence;
+    int fd;
+
+    metrics_register_thread("sink");
+
+    pthread_mutex_lock(&sink_lock);
+    while(1){
+        while(sink_next_ready)
+            pthread_cond_wait(&sink_wanted, &sink_lock);
+        sequence = sink_sequence + 1;
+        pthread_mutex_unlock(&sink_lock);
+
+        fd = sink_open(sequence);
+
+        pthread_mutex_lock(&sink_lock);
+        sink_next_fd = fd;
+        sink_next_ready = 1;
+        pthread_cond_signal(&sink_ready);
+    }
+    return NULL;
+}
+
+static int sink_due(void){
+    return (sink_size > 0 && sink_written >= sink_size)
+           || (sink_period > 0 && time(NULL) - sink_opened >= sink_period);
+}
+
+//Close the current segment and carry on in the one the sink thread has ready.
+static void sink_rotate(void){
+    int fd;
+
+    pthread_mutex_lock(&sink_lock);
+    while(!sink_next_ready)
+        pthread_cond_wait(&sink_ready, &sink_lock);
+    fd = sink_next_fd;
+    pthread_mutex_unlock(&sink_lock);
+    if(fd < 0){
+        //Try again at the next line, in the same segment until then
+        __atomic_add_fetch(&sink_failures, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&sink_lock);
+        sink_next_ready = 0;
+        pthread_cond_signal(&sink_wanted);
+        pthread_mutex_unlock(&sink_lock);
+        return;
+    }
+
+    if(output_level > 0){
+        output_deflate(NULL, 0, Z_FINISH);
+        deflateReset(&output_zip);
+    }
+    //Give back the space reserved past what was written
+    if(ftruncate(output_fd, sink_written) != 0)
+        __atomic_add_fetch(&sink_failures, 1, __ATOMIC_RELAXED);
+    close(output_fd);
+
+    output_fd = fd;
+    sink_written = 0;
+    sink_opened = time(NULL);
+    __atomic_add_fetch(&sink_rotations, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&sink_lock);
+    sink_sequence++;
+    sink_next_ready = 0;
+    pthread_cond_signal(&sink_wanted);
+    pthread_mutex_unlock(&sink_lock);
+}
+
+//At exit: trim the last segment and remove the one prepared after it.
+static void sink_close(void){
+    char path[PATH_MAX];
+
+    if(ftruncate(output_fd, sink_written) != 0)
+        __atomic_add_fetch(&sink_failures, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&sink_lock);
+    while(!sink_next_ready)
+        pthread_cond_wait(&sink_ready, &sink_lock);
+    if(sink_next_fd >= 0){
+        sink_name(sink_sequence + 1, path, sizeof(path));
+        unlink(path);
+        close(sink_next_fd);
+        sink_next_fd = -1;
+    }
+    pthread_mutex_unlock(&sink_lock);
+}
+
+//Wait for a backlog and move it to fd 1, compressed or not.
+static void * output_thread(void * arg){
+    char chunk[OUTPUT_CHUNK];
+    const char * piece, * end;
+    struct timespec flush_by;
+    size_t size;
+    int rotate;
+
+    metrics_register_thread("output");
+
+    pthread_mutex_lock(&output_lock);
+    while(1){
+        size = output_next(chunk, &piece);
+        if(size == 0){
+            if(output_closing)
+                break;
+            if(output_unflushed){
+                //Give more output a moment to join the frame before flushing it
+                clock_gettime(CLOCK_REALTIME, &flush_by);
+                flush_by.tv_nsec += OUTPUT_FLUSH_MS * 1000000L;
+                if(flush_by.tv_nsec >= 1000000000L){
+                    flush_by.tv_sec++;
+                    flush_by.tv_nsec -= 1000000000L;
+                }
+                if(pthread_cond_timedwait(&output_backlogged, &output_lock, &flush_by) == ETIMEDOUT
+                   && !output_backlog()){
+                    pthread_mutex_unlock(&output_lock);
+                    output_deflate(NULL, 0, Z_SYNC_FLUSH);
+                    pthread_mutex_lock(&output_lock);
+                }
+            } else
+                pthread_cond_wait(&output_backlogged, &output_lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&output_lock);
+        //A segment that is due ends at the next line
+        rotate = sink_path != NULL && sink_due() && (end = memchr(piece, '\n', size)) != NULL;
+        if(rotate)
+            size = end + 1 - piece;
+        if(output_level > 0)
+            output_deflate(piece, size, Z_NO_FLUSH);
+        else
+            output_write(piece, size);
+        if(rotate)
+            sink_rotate();
+        pthread_mutex_lock(&output_lock);
+        output_consume(size);
+    }
+    pthread_mutex_unlock(&output_lock);
+
+    if(output_level > 0){
+        output_deflate(NULL, 0, Z_FINISH);
+        deflateEnd(&output_zip);
+    }
+    if(sink_path != NULL)
+        sink_close();
+
+    pthread_mutex_lock(&output_lock);
+    output_closed = 1;
+    pthread_cond_broadcast(&output_finished);
+    pthread_mutex_unlock(&output_lock);
+    return NULL;
+}
+
+//Write function of the replacement stdout stream. Never waits for the reader.
+static ssize_t output_cookie_write(void * cookie, const char * buffer, size_t size){
+    pthread_mutex_lock(&output_lock);
+    if(!output_backlog())
+        pthread_cond_signal(&output_backlogged);
+    output_append(buffer, size);
+    pthread_mutex_unlock(&output_lock);
+    return size;
+}
+
+//At exit: let the output thread write out the last of the backlog, and put fd 1 back.
+static void output_finish(void){
+    fflush(stdout);
+    pthread_mutex_lock(&output_lock);
+    output_closing = 1;
+    pthread_cond_signal(&output_backlogged);
+    while(!output_closed)
+        pthread_cond_wait(&output_finished, &output_lock);
+    pthread_mutex_unlock(&output_lock);
+    if(output_flags >= 0)
+        fcntl(output_fd, F_SETFL, output_flags);
+}
+
+/* Send output to segments of path rather than to fd 1, starting a
+ * new one after size bytes (0: any size) or period seconds (0: any
+ * age), and keeping at most segments of them (0: all). Call before
+ * output_init.
+ */
+int output_sink(const char * path, long long size, int period, int segments){
+    sink_path = path;
+    sink_size = size;
+    sink_period = period;
+    sink_segments = segments;
+    sink_sequence = 0;
+    output_fd = sink_open(0);
+    if(output_fd < 0){
+        output_fd = 1;
+        return errno;
+    }
+    sink_opened = time(NULL);
+    return 0;
+}
+
+/* Hand stdout to the output thread. Spilled output goes to
+ * spill_path, or to an unlinked file in /tmp if NULL. A level of 1
+ * to 9 gzip compresses everything written, 0 leaves it as it is.
+ * Call before starting threads.
+ */
+int output_init(const char * spill_path, int level){
+    cookie_io_functions_t functions = { NULL, output_cookie_write, NULL, NULL };
+    struct stat info;
+    pthread_t thread;
+    FILE * stream;
+    int status, flags;
+
+    output_spill_path = spill_path;
+    output_memory = malloc(OUTPUT_MEMORY);
+    if(output_memory == NULL)
+        return ENOMEM;
+
+    output_level = level;
+    //windowBits 15 + 16 for a gzip header rather than zlib's
+    if(level > 0 && deflateInit2(&output_zip, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return EINVAL;
+
+    if(sink_path != NULL){
+        status = pthread_create(&thread, NULL, sink_thread, NULL);
+        if(status != 0 || (status = pthread_detach(thread)) != 0)
+            return status;
+        goto stream;
+    }
+
+    /* O_NONBLOCK belongs to the open file, which fd 1 shares with the
+     * shell and with the launcher's commands. For a pipe or terminal,
+     * open it again and only make our own open nonblocking.
+     */
+    if(fstat(1, &info) == 0 && (S_ISFIFO(info.st_mode) || S_ISCHR(info.st_mode)))
+        output_fd = open("/proc/self/fd/1", O_WRONLY | O_CLOEXEC);
+    if(output_fd < 0)
+        output_fd = 1;
+    flags = fcntl(output_fd, F_GETFL);
+    if(flags < 0 || fcntl(output_fd, F_SETFL, flags | O_NONBLOCK) != 0)
+        return errno;
+    if(output_fd == 1)
+        output_flags = flags;
+
+stream:
+    stream = fopencookie(NULL, "w", functions);
+    if(stream == NULL)
+        return errno;
+    //Buffered as stdout would have been
+    setvbuf(stream, NULL, sink_path == NULL && isatty(1) ? _IOLBF : _IOFBF, BUFSIZ);
+    fflush(stdout);
+    stdout = stream;
+
+    status = pthread_create(&thread, NULL, output_thread, NULL);
+    if(status != 0)
+        return status;
+    atexit(output_finish);
+    return pthread_detach(thread);
+}
+
+//Upper bound of the bucket the given fraction of writes falls in
+static unsigned long long output_percentile(unsigned long long * buckets, unsigned long long total, double fraction){
+    unsigned long long seen = 0;
+    int i;
+
+    for(i = 0; i < OUTPUT_BUCKETS; i++){
+        seen += buckets[i];
+        if(seen >= total * fraction)
+            return i == 0 ? 0 : 1ULL << i;
+    }
+    return 1ULL << (OUTPUT_BUCKETS - 1);
+}
+
+void output_stats(FILE * out){
+    unsigned long long accepted, written, spilled, lost;
+    unsigned long long buckets[OUTPUT_BUCKETS], writes = 0;
+    size_t memory_peak, backlog;
+    off_t spill_peak;
+    int i;
+
+    pthread_mutex_lock(&output_lock);
+    accepted = output_accepted;
+    written = __atomic_load_n(&output_written, __ATOMIC_RELAXED);
+    spilled = output_spilled;
+    lost = __atomic_load_n(&output_lost, __ATOMIC_RELAXED);
+    memory_peak = output_memory_peak;
+    spill_peak = output_spill_peak;
+    backlog = output_used + (output_spill_write - output_spill_read);
+    pthread_mutex_unlock(&output_lock);
+
+    fprintf(out, "Output: %llu bytes in, %llu written", accepted, written);
+    if(output_level > 0 && written > 0)
+        fprintf(out, " (gzip %.1f:1)", (double)accepted / written);
+    fprintf(out, ", memory peak %zu, %llu spilled to disk (peak %lld), %zu pending, %llu lost\n",
+            memory_peak, spilled, (long long)spill_peak, backlog, lost);
+
+    for(i = 0; i < OUTPUT_BUCKETS; i++)
+        writes += buckets[i] = __atomic_load_n(&output_latency[i], __ATOMIC_RELAXED);
+    if(writes > 0)
+        fprintf(out, "Output writes: %llu, latency p50 %lluus p99 %lluus p99.9 %lluus max %lluus\n", writes,
+                output_percentile(buckets, writes, 0.5), output_percentile(buckets, writes, 0.99),
+                output_percentile(buckets, writes, 0.999), __atomic_load_n(&output_latency_max, __ATOMIC_RELAXED));
+    if(sink_path != NULL)
+        fprintf(out, "Sink: segment %lu of %s, %lu rotations, %lu failed opens or allocations\n",
+                __atomic_load_n(&sink_sequence, __ATOMIC_RELAXED), sink_path,
+                __atomic_load_n(&sink_rotations, __ATOMIC_RELAXED),
+                __atomic_load_n(&sink_failures, __ATOMIC_RELAXED));
+}
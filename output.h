@@ -0,0 +1,39 @@
+#ifndef __output_h
+#define __output_h
+
+#include <stdio.h>
+
+/*
+ * output.h
+ *
+ * Stdout writer. output_init replaces the stdout stream with one
+ * whose writes only append to a backlog: a bounded in-memory ring,
+ * and once that is full a spill file on disk. The output thread is
+ * the only one that writes fd 1; it drains the backlog in order,
+ * optionally gzip compressing it on the way, and waits for the
+ * reader itself. So printf(), flockfile() and fflush() on stdout all
+ * work as before, but the display threads never make the write
+ * system call and a stalled reader can no longer stop them.
+ *
+ * With output_sink, the output goes to a file instead, in segments
+ * path.0, path.1, ... rotated by size and/or age. A sink thread opens
+ * and fallocates the next segment while the current one is written,
+ * so rotating is a swap of file descriptors and appends never wait
+ * for block allocation. With a fixed number of segments the oldest
+ * is overwritten.
+ */
+
+//Bytes held in memory before output spills to disk
+#define OUTPUT_MEMORY (1 << 20)
+//Space reserved ahead for a segment with no size limit
+#define OUTPUT_PREALLOCATE (16LL << 20)
+//Write latency histogram: bucket 0 is under 1 usec, bucket i is under 2^i usec
+#define OUTPUT_BUCKETS 32
+//How long compressed output may sit in the compressor before it is flushed
+#define OUTPUT_FLUSH_MS 200
+
+int output_sink(const char * path, long long size, int period, int segments);
+int output_init(const char * spill_path, int level);
+void output_stats(FILE * out);
+
+#endif
@@ -0,0 +1,209 @@
+/*
+ * pipeline.c
+ *
+ * Pipelined parsing, see pipeline.h. The reader emits whatever whole
+ * lines each read gave it, so a file or a busy pipe comes in large
+ * chunks while a terminal still gets a chunk per line. One mutex
+ * covers the ring and the turn counter; the ring is only touched
+ * once a chunk, and the turn once a chunk's hook, so it is never held
+ * for long.
+ */
+#include <pthread.h>
+#include "errors.h"
+#include "pipeline.h"
+#include "metrics.h"
+
+static pthread_mutex_t pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipeline_ready = PTHREAD_COND_INITIALIZER;   /* a chunk, or the end */
+static pthread_cond_t pipeline_space = PTHREAD_COND_INITIALIZER;   /* a free slot */
+static pthread_cond_t pipeline_passed = PTHREAD_COND_INITIALIZER;  /* the turn moved on */
+
+static pipeline_chunk_t * ring[PIPELINE_DEPTH];
+static unsigned long ring_read, ring_taken;     /* chunks put on and taken off */
+static unsigned long turn;                      /* first chunk not passed yet */
+static int ended;
+
+static int pipeline_fd;
+static int parser_count;
+static pipeline_parse_t parse_hook;
+static pipeline_setup_t setup_hook;
+static pthread_t reader, parsers[PIPELINE_MAX];
+
+//For pipeline_stats
+static unsigned long long total_bytes;
+static unsigned long reader_stalls;
+static unsigned long long turn_wait_ns;
+
+static unsigned long long pipeline_now_ns(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//Put length bytes of data on the ring, waiting for a slot.
+static void pipeline_emit(char * data, size_t length, struct timespec * read_at){
+    pipeline_chunk_t * chunk = malloc(sizeof(pipeline_chunk_t));
+
+    if(chunk == NULL)
+        errno_abort("Allocate input chunk");
+    data[length] = '\0';
+    chunk->data = data;
+    chunk->length = length;
+    chunk->read_at = *read_at;
+
+    pthread_mutex_lock(&pipeline_lock);
+    if(ring_read - ring_taken == PIPELINE_DEPTH)
+        reader_stalls++;
+    while(ring_read - ring_taken == PIPELINE_DEPTH)
+        pthread_cond_wait(&pipeline_space, &pipeline_lock);
+    chunk->sequence = ring_read;
+    ring[ring_read++ % PIPELINE_DEPTH] = chunk;
+    total_bytes += length;
+    pthread_cond_signal(&pipeline_ready);
+    pthread_mutex_unlock(&pipeline_lock);
+}
+
+static char * pipeline_buffer(void){
+    char * buffer = malloc(PIPELINE_CHUNK + 1);
+
+    if(buffer == NULL)
+        errno_abort("Allocate input buffer");
+    return buffer;
+}
+
+static void * reader_thread(void * arg){
+    struct timespec read_at;
+    char * buffer = pipeline_buffer(), * rest;
+    size_t have = 0, lines;
+    ssize_t got;
+
+    metrics_register_thread("reader");
+    while(1){
+        got = read(pipeline_fd, buffer + have, PIPELINE_CHUNK - have);
+        if(got < 0 && errno == EINTR)
+            continue;
+        if(got < 0)
+            errno_abort("Read input");
+        clock_gettime(CLOCK_REALTIME, &read_at);
+        if(got == 0)
+            break;
+        have += got;
+
+        //Up to the last newline, or all of it if a line fills the chunk
+        for(lines = have; lines > 0 && buffer[lines - 1] != '\n'; lines--)
+            ;
+        if(lines == 0 && have < PIPELINE_CHUNK)
+            continue;
+        if(lines == 0)
+            lines = have;
+
+        rest = pipeline_buffer();
+        memcpy(rest, buffer + lines, have - lines);
+        pipeline_emit(buffer, lines, &read_at);
+        buffer = rest;
+        have -= lines;
+    }
+
+    //A last line without a newline
+    if(have > 0)
+        pipeline_emit(buffer, have, &read_at);
+    else
+        free(buffer);
+
+    pthread_mutex_lock(&pipeline_lock);
+    ended = 1;
+    pthread_cond_broadcast(&pipeline_ready);
+    pthread_mutex_unlock(&pipeline_lock);
+    return NULL;
+}
+
+/* Wait until every chunk before this one has been through its hook.
+ * Returns at once if they have, or if this chunk has had its turn.
+ */
+void pipeline_turn(pipeline_chunk_t * chunk){
+    unsigned long long start;
+
+    if(__atomic_load_n(&turn, __ATOMIC_ACQUIRE) >= chunk->sequence)
+        return;
+    start = pipeline_now_ns();
+    pthread_mutex_lock(&pipeline_lock);
+    while(turn < chunk->sequence)
+        pthread_cond_wait(&pipeline_passed, &pipeline_lock);
+    turn_wait_ns += pipeline_now_ns() - start;
+    pthread_mutex_unlock(&pipeline_lock);
+}
+
+static void * parser_thread(void * arg){
+    pipeline_chunk_t * chunk;
+
+    if(setup_hook != NULL)
+        setup_hook((int)(long)arg);
+    while(1){
+        pthread_mutex_lock(&pipeline_lock);
+        while(ring_taken == ring_read && !ended)
+            pthread_cond_wait(&pipeline_ready, &pipeline_lock);
+        if(ring_taken == ring_read){
+            pthread_mutex_unlock(&pipeline_lock);
+            break;
+        }
+        chunk = ring[ring_taken++ % PIPELINE_DEPTH];
+        pthread_cond_signal(&pipeline_space);
+        pthread_mutex_unlock(&pipeline_lock);
+
+        parse_hook(chunk);
+        //In case the hook had nothing to do in order
+        pipeline_turn(chunk);
+
+        pthread_mutex_lock(&pipeline_lock);
+        __atomic_store_n(&turn, chunk->sequence + 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&pipeline_passed);
+        pthread_mutex_unlock(&pipeline_lock);
+        free(chunk->data);
+        free(chunk);
+    }
+    return NULL;
+}
+
+/* Start reading fd with a reader thread and parsing it with parsers
+ * parser threads (at most PIPELINE_MAX). Returns 0 or an error number.
+ */
+int pipeline_start(int fd, int parsers_wanted, pipeline_parse_t parse, pipeline_setup_t setup){
+    int status, i;
+
+    if(parsers_wanted < 1 || parsers_wanted > PIPELINE_MAX)
+        return EINVAL;
+    pipeline_fd = fd;
+    parse_hook = parse;
+    setup_hook = setup;
+    for(i = 0; i < parsers_wanted; i++){
+        status = pthread_create(&parsers[i], NULL, parser_thread, (void *)(long)(i + 1));
+        if(status != 0)
+            return status;
+        parser_count++;
+    }
+    return pthread_create(&reader, NULL, reader_thread, NULL);
+}
+
+//Block until the input has ended and every chunk has been parsed.
+void pipeline_wait(void){
+    int i;
+
+    pthread_join(reader, NULL);
+    for(i = 0; i < parser_count; i++)
+        pthread_join(parsers[i], NULL);
+}
+
+void pipeline_stats(FILE * out){
+    unsigned long chunks;
+
+    if(parser_count == 0)
+        return;
+    pthread_mutex_lock(&pipeline_lock);
+    chunks = ring_read;
+    fprintf(out, "Pipeline: %d parsers, %lu chunks, %llu bytes, %lu waiting to be parsed\n",
+            parser_count, chunks, total_bytes, ring_read - ring_taken);
+    fprintf(out, "Pipeline: reader stalled %lu times on a full ring, parsers waited %.1f ms for their turn\n",
+            reader_stalls, turn_wait_ns / 1e6);
+    pthread_mutex_unlock(&pipeline_lock);
+}
@@ -0,0 +1,47 @@
+#ifndef __pipeline_h
+#define __pipeline_h
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * pipeline.h
+ *
+ * Pipelined parsing of one input stream. A reader thread reads the
+ * stream in PIPELINE_CHUNK sized pieces, cut at the last newline,
+ * numbers them and hands them round a ring of PIPELINE_DEPTH slots
+ * to several parser threads. Each parser runs the parse hook on a
+ * chunk at a time, any number of chunks at once, and the hook calls
+ * pipeline_turn before the part of its work that has to happen in
+ * input order: that waits until every earlier chunk's hook has
+ * returned. So the slow part of parsing runs on every parser and
+ * only the hand-off is sequential.
+ *
+ * Every line of a chunk was read at the chunk's read time, which
+ * only goes forward from chunk to chunk.
+ */
+
+//Bytes read at a time, and most chunks waiting to be parsed
+#define PIPELINE_CHUNK (256 * 1024)
+#define PIPELINE_DEPTH 16
+//Most parser threads
+#define PIPELINE_MAX 8
+
+typedef struct pipeline_chunk {
+    unsigned long sequence;
+    struct timespec read_at;    /* CLOCK_REALTIME */
+    size_t length;
+    char * data;                /* whole lines, NUL terminated, writable */
+} pipeline_chunk_t;
+
+//Parses a chunk; called by several parser threads at once
+typedef void (*pipeline_parse_t)(pipeline_chunk_t * chunk);
+//Called by each parser thread, numbered from 1, before its first chunk
+typedef void (*pipeline_setup_t)(int index);
+
+int pipeline_start(int fd, int parsers, pipeline_parse_t parse, pipeline_setup_t setup);
+void pipeline_turn(pipeline_chunk_t * chunk);
+void pipeline_wait(void);
+void pipeline_stats(FILE * out);
+
+#endif
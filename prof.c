@@ -0,0 +1,318 @@
+/*
+ * prof.c
+ *
+ * Sampling profiler for My_Alarm. Each thread registers itself
+ * with a role, and gets a CLOCK_THREAD_CPUTIME_ID timer aimed at
+ * its own thread id, so only CPU actually burnt by that thread
+ * produces samples. The SIGPROF handler takes a backtrace and
+ * counts it in a fixed size per-thread table, keyed by stage and
+ * stack, so memory never grows no matter how long it runs.
+ * Symbols are only resolved when a dump is requested.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <sys/syscall.h>
+#include "errors.h"
+#include "prof.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define PROF_MAX_THREADS 16
+#define PROF_MAX_DEPTH 16
+#define PROF_TABLE_SIZE 4096
+//Frames belonging to the handler and the signal trampoline
+#define PROF_SKIP_FRAMES 2
+#define PROF_NAME_SIZE 32
+
+//One distinct (stage, stack) pair and the number of times it was seen
+typedef struct prof_entry {
+    volatile unsigned long hash;
+    int stage;
+    int depth;
+    void * pc[PROF_MAX_DEPTH];
+    volatile unsigned long count;
+} prof_entry_t;
+
+typedef struct prof_thread {
+    int role;
+    int index;
+    timer_t timer;
+    volatile unsigned long dropped;
+    prof_entry_t table[PROF_TABLE_SIZE];
+} prof_thread_t;
+
+int prof_enabled = 0;
+__thread volatile int prof_stage = PROF_STAGE_IDLE;
+
+static int prof_hz;
+static __thread prof_thread_t * prof_self = NULL;
+static prof_thread_t * prof_threads[PROF_MAX_THREADS];
+static int prof_thread_count = 0;
+
+static const char * prof_role_names[] = { "parser", "dispatcher", "display_shard" };
+static const char * prof_stage_names[PROF_STAGE_COUNT] = {
+    "idle", "read", "parse", "wait", "dispatch", "poll", "fire", "receive"
+};
+
+/* SIGPROF handler. Runs on the thread whose timer expired.
+ *
+ * Only the owning thread ever writes its table, so publishing the
+ * hash after the stack has been filled in is enough for a reader.
+ */
+static void prof_handler(int sig, siginfo_t * info, void * context){
+    prof_thread_t * self = prof_self;
+    prof_entry_t * entry;
+    void * pc[PROF_MAX_DEPTH + PROF_SKIP_FRAMES];
+    unsigned long hash;
+    int depth, stage, slot, probe, i;
+    int saved_errno = errno;
+
+    if(self == NULL)
+        return;
+
+    stage = prof_stage;
+    depth = backtrace(pc, PROF_MAX_DEPTH + PROF_SKIP_FRAMES) - PROF_SKIP_FRAMES;
+    if(depth < 0)
+        depth = 0;
+
+    //FNV-1a over the stage and the program counters
+    hash = 1469598103934665603UL ^ (unsigned long)stage;
+    for(i = 0; i < depth; i++)
+        hash = (hash ^ (unsigned long)pc[i + PROF_SKIP_FRAMES]) * 1099511628211UL;
+    //Zero marks an empty slot
+    if(hash == 0)
+        hash = 1;
+
+    slot = hash % PROF_TABLE_SIZE;
+    for(probe = 0; probe < PROF_TABLE_SIZE; probe++){
+        entry = &self->table[(slot + probe) % PROF_TABLE_SIZE];
+        if(entry->hash == hash){
+            entry->count++;
+            errno = saved_errno;
+            return;
+        }
+        if(entry->hash == 0){
+            entry->stage = stage;
+            entry->depth = depth;
+            for(i = 0; i < depth; i++)
+                entry->pc[i] = pc[i + PROF_SKIP_FRAMES];
+            entry->count = 1;
+            __atomic_store_n(&entry->hash, hash, __ATOMIC_RELEASE);
+            errno = saved_errno;
+            return;
+        }
+    }
+
+    //Table is full
+    self->dropped++;
+    errno = saved_errno;
+}
+
+/* Install the SIGPROF handler. Threads registered afterwards are sampled
+ * hz times per second of CPU time they use.
+ */
+int prof_init(int hz){
+    struct sigaction action;
+    void * prime[1];
+
+    if(hz <= 0 || hz > 10000)
+        return -1;
+
+    //backtrace() loads libgcc lazily, which must not happen inside the handler.
+    backtrace(prime, 1);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = prof_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(SIGPROF, &action, NULL) != 0)
+        return -1;
+
+    prof_hz = hz;
+    prof_enabled = 1;
+    return 0;
+}
+
+/* Start sampling the calling thread under the given role.
+ * index is the display shard number, and ignored for the other roles.
+ */
+void prof_register_thread(int role, int index){
+    prof_thread_t * self;
+    struct sigevent event;
+    struct itimerspec interval;
+    long long period;
+    int slot;
+
+    if(!prof_enabled)
+        return;
+
+    slot = __atomic_fetch_add(&prof_thread_count, 1, __ATOMIC_ACQ_REL);
+    if(slot >= PROF_MAX_THREADS){
+        fprintf(stderr, "Profiler: too many threads, not sampling %s %d\n",
+                prof_role_names[role], index);
+        return;
+    }
+
+    self = calloc(1, sizeof(prof_thread_t));
+    if(self == NULL)
+        errno_abort("Allocate profiler thread");
+    self->role = role;
+    self->index = index;
+
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = syscall(SYS_gettid);
+    if(timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &self->timer) != 0)
+        errno_abort("Create profiler timer");
+
+    prof_self = self;
+    __atomic_store_n(&prof_threads[slot], self, __ATOMIC_RELEASE);
+
+    //At 1 hz the period is a whole second, which tv_nsec can't hold
+    period = 1000000000LL / prof_hz;
+    interval.it_interval.tv_sec = period / 1000000000LL;
+    interval.it_interval.tv_nsec = period % 1000000000LL;
+    interval.it_value = interval.it_interval;
+    if(timer_settime(self->timer, 0, &interval, NULL) != 0)
+        errno_abort("Arm profiler timer");
+}
+
+//Name of the function containing pc, or NULL if it can't be resolved
+static const char * prof_symbol(void * pc){
+    Dl_info info;
+
+    if(dladdr(pc, &info) == 0 || info.dli_sname == NULL)
+        return NULL;
+    return info.dli_sname;
+}
+
+static void prof_thread_name(prof_thread_t * thread, char * name){
+    //Main parses as plain "parser"; -i and -j parsers are numbered from 1
+    if(thread->role == PROF_ROLE_DISPLAY || (thread->role == PROF_ROLE_PARSER && thread->index > 0))
+        snprintf(name, PROF_NAME_SIZE, "%s_%d", prof_role_names[thread->role], thread->index);
+    else
+        snprintf(name, PROF_NAME_SIZE, "%s", prof_role_names[thread->role]);
+}
+
+/* Print a per-thread summary: samples per stage and the functions
+ * the samples landed in (self time).
+ */
+void prof_dump(FILE * out){
+    prof_thread_t * thread;
+    prof_entry_t * entry;
+    unsigned long stage_count[PROF_STAGE_COUNT];
+    unsigned long total, func_count[PROF_TABLE_SIZE];
+    const char * func_name[PROF_TABLE_SIZE];
+    const char * name;
+    char thread_name[PROF_NAME_SIZE];
+    int t, i, j, functions, threads;
+
+    if(!prof_enabled){
+        fprintf(out, "Profiler disabled, start with -p <hz>\n");
+        return;
+    }
+
+    threads = __atomic_load_n(&prof_thread_count, __ATOMIC_ACQUIRE);
+    if(threads > PROF_MAX_THREADS)
+        threads = PROF_MAX_THREADS;
+
+    for(t = 0; t < threads; t++){
+        thread = __atomic_load_n(&prof_threads[t], __ATOMIC_ACQUIRE);
+        if(thread == NULL)
+            continue;
+
+        memset(stage_count, 0, sizeof(stage_count));
+        total = 0;
+        functions = 0;
+        for(i = 0; i < PROF_TABLE_SIZE; i++){
+            entry = &thread->table[i];
+            if(__atomic_load_n(&entry->hash, __ATOMIC_ACQUIRE) == 0)
+                continue;
+            stage_count[entry->stage] += entry->count;
+            total += entry->count;
+
+            name = entry->depth > 0 ? prof_symbol(entry->pc[0]) : NULL;
+            if(name == NULL)
+                name = "[unknown]";
+            for(j = 0; j < functions; j++)
+                if(strcmp(func_name[j], name) == 0)
+                    break;
+            if(j == functions){
+                func_name[functions] = name;
+                func_count[functions++] = 0;
+            }
+            func_count[j] += entry->count;
+        }
+
+        prof_thread_name(thread, thread_name);
+        fprintf(out, "Profile %s: %lu samples at %d Hz, %lu dropped\n",
+                thread_name, total, prof_hz, thread->dropped);
+        if(total == 0)
+            continue;
+        for(i = 0; i < PROF_STAGE_COUNT; i++)
+            if(stage_count[i] != 0)
+                fprintf(out, "  stage %-10s %8lu %5.1f%%\n", prof_stage_names[i],
+                        stage_count[i], stage_count[i] * 100.0 / total);
+        for(i = 0; i < functions; i++)
+            fprintf(out, "  func  %-24s %8lu %5.1f%%\n", func_name[i],
+                    func_count[i], func_count[i] * 100.0 / total);
+    }
+    fflush(out);
+}
+
+/* Write every sampled stack in folded format (one
+ * "thread;stage;outer;...;inner count" line each), suitable for
+ * flamegraph.pl and speedscope.
+ */
+int prof_dump_folded(const char * path){
+    FILE * out;
+    prof_thread_t * thread;
+    prof_entry_t * entry;
+    const char * name;
+    char thread_name[PROF_NAME_SIZE];
+    int t, i, frame, threads;
+
+    if(!prof_enabled)
+        return -1;
+
+    out = fopen(path, "w");
+    if(out == NULL)
+        return -1;
+
+    threads = __atomic_load_n(&prof_thread_count, __ATOMIC_ACQUIRE);
+    if(threads > PROF_MAX_THREADS)
+        threads = PROF_MAX_THREADS;
+
+    for(t = 0; t < threads; t++){
+        thread = __atomic_load_n(&prof_threads[t], __ATOMIC_ACQUIRE);
+        if(thread == NULL)
+            continue;
+        prof_thread_name(thread, thread_name);
+
+        for(i = 0; i < PROF_TABLE_SIZE; i++){
+            entry = &thread->table[i];
+            if(__atomic_load_n(&entry->hash, __ATOMIC_ACQUIRE) == 0)
+                continue;
+            fprintf(out, "%s;%s", thread_name, prof_stage_names[entry->stage]);
+            //Backtraces are innermost first, folded stacks are outermost first
+            for(frame = entry->depth - 1; frame >= 0; frame--){
+                name = prof_symbol(entry->pc[frame]);
+                if(name != NULL)
+                    fprintf(out, ";%s", name);
+                else
+                    fprintf(out, ";%p", entry->pc[frame]);
+            }
+            fprintf(out, " %lu\n", entry->count);
+        }
+    }
+
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef __prof_h
+#define __prof_h
+
+#include <stdio.h>
+
+/*
+ * prof.h
+ *
+ * Opt-in in-process sampling profiler. Every registered thread
+ * gets its own CPU-time timer which delivers SIGPROF to that
+ * thread only, so samples are attributed to the thread role
+ * (parser, dispatcher, display shard N) and to the pipeline
+ * stage the thread last entered with PROF_STAGE().
+ */
+
+//Thread roles
+#define PROF_ROLE_PARSER 0
+#define PROF_ROLE_DISPATCHER 1
+#define PROF_ROLE_DISPLAY 2
+
+//Pipeline stages
+#define PROF_STAGE_IDLE 0
+#define PROF_STAGE_READ 1
+#define PROF_STAGE_PARSE 2
+#define PROF_STAGE_WAIT 3
+#define PROF_STAGE_DISPATCH 4
+#define PROF_STAGE_POLL 5
+#define PROF_STAGE_FIRE 6
+#define PROF_STAGE_RECEIVE 7
+#define PROF_STAGE_COUNT 8
+
+//Non zero once prof_init has succeeded
+extern int prof_enabled;
+//Stage of the calling thread, read from the SIGPROF handler
+extern __thread volatile int prof_stage;
+
+#define PROF_STAGE(s) (prof_stage = (s))
+
+int prof_init(int hz);
+void prof_register_thread(int role, int index);
+void prof_dump(FILE * out);
+int prof_dump_folded(const char * path);
+
+#endif
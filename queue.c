@@ -0,0 +1,975 @@
+/*
+ * queue.c
+ *
+ * Shard alarm queue with lazy insertion. Time is cut into periods
+ * of horizon seconds. Alarms due in the current or next period are
+ * sorted into the list straight away; later ones are pushed onto the
+ * staging bucket of their period, which is O(1), as is unlinking
+ * them again on cancel. When a period becomes the next one, its
+ * bucket is swept and the alarms due in it are sorted into the list.
+ * Buckets are reused every QUEUE_STAGE_BUCKETS periods, so a bucket
+ * can hold alarms for later laps too; those stay where they are.
+ *
+ * Every alarm on the list is due before every staged alarm, so the
+ * head of the list is always the next alarm to fire.
+ *
+ * Queued alarms keep their time relative to the queue epoch, and the
+ * staging periods are periods of that relative time, so a shift or a
+ * pause/resume only ever moves the epoch, and the key base with it.
+ *
+ * "The list" above is whichever backend the queue is on. The heap
+ * keeps keys in its entry array so sifting does not touch the alarms.
+ * The wheel hashes alarms by key slot; a slot holds alarms from every
+ * lap, and finding the first alarm scans forward from a cursor no
+ * alarm is behind, so it is cached until the wheel changes.
+ */
+#include "errors.h"
+#include "queue.h"
+
+/* Appends to the list of alarms, sorted by smallest time.
+ *
+ * If the alarm item finishes sooner than the old alarm,
+ * Append to it before
+ */
+void appendToList(alarm_t ** base_list, alarm_t * new_item){
+
+    alarm_t * old = *base_list;
+
+
+    while (*base_list != NULL) {
+        //If before another item, append.
+        //Keys too far out to encode compare by their full time,
+        //and alarms due together go in the order they were numbered.
+        if (new_item->key < old->key
+            || (new_item->key == old->key
+                && (new_item->key != QUEUE_KEY_FAR ? new_item->id < old->id
+                    : new_item->time.tv_sec < old->time.tv_sec
+                      || (new_item->time.tv_sec == old->time.tv_sec
+                          && (new_item->time.tv_nsec < old->time.tv_nsec
+                              || (new_item->time.tv_nsec == old->time.tv_nsec
+                                  && new_item->id < old->id)))))) {
+            new_item->link = old;
+            new_item->pprev = base_list;
+            old->pprev = &new_item->link;
+
+            *base_list = new_item;
+            break;
+        }
+        base_list = &((*base_list)->link);
+        old = *base_list;
+    }
+
+    //End of list reached
+    //Append new item to end of list
+    if (*base_list == NULL) {
+        new_item->link = NULL;
+        new_item->pprev = base_list;
+        *base_list = new_item;
+    }
+
+}
+
+static void timespec_add(struct timespec * to, const struct timespec * add){
+    to->tv_sec += add->tv_sec;
+    to->tv_nsec += add->tv_nsec;
+    if(to->tv_nsec >= 1000000000L){
+        to->tv_sec++;
+        to->tv_nsec -= 1000000000L;
+    }
+}
+
+static void timespec_sub(struct timespec * from, const struct timespec * sub){
+    from->tv_sec -= sub->tv_sec;
+    from->tv_nsec -= sub->tv_nsec;
+    if(from->tv_nsec < 0){
+        from->tv_sec--;
+        from->tv_nsec += 1000000000L;
+    }
+}
+
+/* How far past its deadline a spread alarm is put off: its window
+ * times the fractional part of its id times the golden ratio. Alarms
+ * numbered one after another land evenly across the window, and an
+ * alarm lands in the same place every time it is queued.
+ */
+static long queue_spread_usec(alarm_t * alarm){
+    unsigned long long fraction;
+
+    if(alarm->spread_ms <= 0)
+        return 0;
+    fraction = (unsigned long long)alarm->id * 0x9E3779B97F4A7C15ULL;
+    return (long)(((fraction >> 32) * (unsigned long long)alarm->spread_ms * 1000ULL) >> 32);
+}
+
+//Make a new alarm's time relative, and spread it
+static void queue_relative(queue_t * queue, alarm_t * alarm){
+    long spread = queue_spread_usec(alarm);
+
+    timespec_sub(&alarm->time, &queue->epoch);
+    alarm->time.tv_sec += spread / 1000000;
+    alarm->time.tv_nsec += spread % 1000000 * 1000;
+    if(alarm->time.tv_nsec >= 1000000000L){
+        alarm->time.tv_sec++;
+        alarm->time.tv_nsec -= 1000000000L;
+    }
+}
+
+//Give an alarm leaving the queue back its absolute, unspread time
+static void queue_absolute(queue_t * queue, alarm_t * alarm){
+    long spread = queue_spread_usec(alarm);
+
+    timespec_add(&alarm->time, &queue->epoch);
+    alarm->time.tv_sec -= spread / 1000000;
+    alarm->time.tv_nsec -= spread % 1000000 * 1000;
+    if(alarm->time.tv_nsec < 0){
+        alarm->time.tv_sec--;
+        alarm->time.tv_nsec += 1000000000L;
+    }
+}
+
+//Index key of a queued alarm, whose time is relative
+static bt_key_t queue_index_key(alarm_t * alarm){
+    bt_key_t key;
+
+    key.when = (long long)alarm->time.tv_sec * 1000000LL + alarm->time.tv_nsec / 1000;
+    key.id = alarm->id;
+    return key;
+}
+
+//Index key at or before every alarm due at the absolute time when
+static bt_key_t queue_window_key(queue_t * queue, const struct timespec * when){
+    struct timespec relative = *when;
+    bt_key_t key;
+
+    timespec_sub(&relative, &queue->epoch);
+    key.when = (long long)relative.tv_sec * 1000000LL + relative.tv_nsec / 1000;
+    key.id = 0;
+    return key;
+}
+
+//Take an alarm off whichever list it is on.
+static void queue_unlink(alarm_t * alarm){
+    *alarm->pprev = alarm->link;
+    if(alarm->link != NULL)
+        alarm->link->pprev = alarm->pprev;
+    alarm->link = NULL;
+    alarm->pprev = NULL;
+}
+
+//Take an alarm out of the id index.
+static void queue_unindex(queue_t * queue, alarm_t * alarm){
+    alarm_t ** chain = &queue->ids[alarm->id % QUEUE_ID_BUCKETS];
+
+    while(*chain != NULL && *chain != alarm)
+        chain = &(*chain)->id_link;
+    if(*chain != NULL)
+        *chain = alarm->id_link;
+    alarm->id_link = NULL;
+}
+
+//Push an alarm onto the front of an unordered list.
+static void queue_push(alarm_t ** head, alarm_t * alarm){
+    alarm->link = *head;
+    if(*head != NULL)
+        (*head)->pprev = &alarm->link;
+    alarm->pprev = head;
+    *head = alarm;
+}
+
+static const char * queue_backend_names[] = { "list", "heap", "wheel", "adaptive" };
+
+const char * queue_backend_name(int backend){
+    if(backend < 0 || backend > QUEUE_ADAPTIVE)
+        return "unknown";
+    return queue_backend_names[backend];
+}
+
+/* Whether a is due before b, as the list orders them. Alarms due
+ * at the same time go in id order, which is the order they were
+ * submitted in.
+ */
+static int queue_before(alarm_t * a, alarm_t * b){
+    if(a->key != b->key)
+        return a->key < b->key;
+    if(a->key == QUEUE_KEY_FAR && a->time.tv_sec != b->time.tv_sec)
+        return a->time.tv_sec < b->time.tv_sec;
+    if(a->key == QUEUE_KEY_FAR && a->time.tv_nsec != b->time.tv_nsec)
+        return a->time.tv_nsec < b->time.tv_nsec;
+    return a->id < b->id;
+}
+
+static int heap_before(queue_entry_t * a, queue_entry_t * b){
+    if(a->key != b->key)
+        return a->key < b->key;
+    return queue_before(a->alarm, b->alarm);
+}
+
+static void heap_place(queue_t * queue, int slot, queue_entry_t entry){
+    queue->heap[slot] = entry;
+    entry.alarm->slot = slot;
+}
+
+static void heap_up(queue_t * queue, int slot){
+    queue_entry_t entry = queue->heap[slot];
+    int parent;
+
+    while(slot > 0){
+        parent = (slot - 1) / 2;
+        if(!heap_before(&entry, &queue->heap[parent]))
+            break;
+        heap_place(queue, slot, queue->heap[parent]);
+        slot = parent;
+    }
+    heap_place(queue, slot, entry);
+}
+
+static void heap_down(queue_t * queue, int slot, int size){
+    queue_entry_t entry = queue->heap[slot];
+    int child;
+
+    while((child = 2 * slot + 1) < size){
+        if(child + 1 < size && heap_before(&queue->heap[child + 1], &queue->heap[child]))
+            child++;
+        if(!heap_before(&queue->heap[child], &entry))
+            break;
+        heap_place(queue, slot, queue->heap[child]);
+        slot = child;
+    }
+    heap_place(queue, slot, entry);
+}
+
+//Room for size entries in the heap
+static void heap_reserve(queue_t * queue, int size){
+    queue_entry_t * grown;
+    int capacity = queue->heap_capacity ? queue->heap_capacity : 64;
+
+    if(size <= queue->heap_capacity)
+        return;
+    while(capacity < size)
+        capacity *= 2;
+    grown = realloc(queue->heap, capacity * sizeof(queue_entry_t));
+    if(grown == NULL)
+        errno_abort("Grow queue heap");
+    queue->heap = grown;
+    queue->heap_capacity = capacity;
+}
+
+static void heap_insert(queue_t * queue, alarm_t * alarm){
+    heap_reserve(queue, queue->ordered + 1);
+    queue->heap[queue->ordered].key = alarm->key;
+    queue->heap[queue->ordered].alarm = alarm;
+    heap_up(queue, queue->ordered);
+}
+
+static void heap_remove(queue_t * queue, alarm_t * alarm){
+    int slot = alarm->slot;
+    int last = queue->ordered - 1;
+
+    if(slot == last)
+        return;
+    //Fill the hole with the last entry, which may belong above or below it
+    heap_place(queue, slot, queue->heap[last]);
+    heap_down(queue, slot, last);
+    heap_up(queue, slot);
+}
+
+#define WHEEL_TICK(key) ((key) >> QUEUE_WHEEL_SHIFT)
+
+static void wheel_insert(queue_t * queue, alarm_t * alarm){
+    unsigned int tick = WHEEL_TICK(alarm->key);
+
+    queue_push(&queue->wheel[tick % QUEUE_WHEEL_SLOTS], alarm);
+    if(queue->ordered == 0 || tick < queue->wheel_cursor)
+        queue->wheel_cursor = tick;
+    if(queue->wheel_first != NULL && queue_before(alarm, queue->wheel_first))
+        queue->wheel_first = alarm;
+}
+
+static alarm_t * wheel_first(queue_t * queue){
+    alarm_t * alarm, * first = NULL;
+    unsigned int tick;
+    int i;
+
+    if(queue->wheel_first != NULL || queue->ordered == 0)
+        return queue->wheel_first;
+
+    //Slots from the cursor on, for one lap, only counting this lap's alarms
+    for(i = 0, tick = queue->wheel_cursor; i < QUEUE_WHEEL_SLOTS && first == NULL; i++, tick++)
+        for(alarm = queue->wheel[tick % QUEUE_WHEEL_SLOTS]; alarm != NULL; alarm = alarm->link)
+            if(WHEEL_TICK(alarm->key) == tick && (first == NULL || queue_before(alarm, first)))
+                first = alarm;
+
+    //Everything is a lap or more out: look at all of it
+    if(first == NULL)
+        for(i = 0; i < QUEUE_WHEEL_SLOTS; i++)
+            for(alarm = queue->wheel[i]; alarm != NULL; alarm = alarm->link)
+                if(first == NULL || queue_before(alarm, first))
+                    first = alarm;
+
+    queue->wheel_cursor = WHEEL_TICK(first->key);
+    queue->wheel_first = first;
+    return first;
+}
+
+static void backend_insert(queue_t * queue, alarm_t * alarm){
+    switch(queue->backend){
+    case QUEUE_HEAP:
+        heap_insert(queue, alarm);
+        break;
+    case QUEUE_WHEEL:
+        wheel_insert(queue, alarm);
+        break;
+    default:
+        appendToList(&queue->list, alarm);
+    }
+    queue->ordered++;
+}
+
+static void backend_remove(queue_t * queue, alarm_t * alarm){
+    switch(queue->backend){
+    case QUEUE_HEAP:
+        heap_remove(queue, alarm);
+        break;
+    case QUEUE_WHEEL:
+        if(alarm == queue->wheel_first)
+            queue->wheel_first = NULL;
+        queue_unlink(alarm);
+        break;
+    default:
+        queue_unlink(alarm);
+    }
+    queue->ordered--;
+}
+
+//Empty the backend, handing its alarms back chained through link.
+static alarm_t * backend_drain(queue_t * queue){
+    alarm_t * chain = NULL, * alarm, * next;
+    int i;
+
+    switch(queue->backend){
+    case QUEUE_HEAP:
+        for(i = 0; i < queue->ordered; i++){
+            alarm = queue->heap[i].alarm;
+            alarm->link = chain;
+            chain = alarm;
+        }
+        break;
+    case QUEUE_WHEEL:
+        for(i = 0; i < QUEUE_WHEEL_SLOTS; i++){
+            for(alarm = queue->wheel[i]; alarm != NULL; alarm = next){
+                next = alarm->link;
+                alarm->link = chain;
+                chain = alarm;
+            }
+            queue->wheel[i] = NULL;
+        }
+        queue->wheel_first = NULL;
+        break;
+    default:
+        chain = queue->list;
+        queue->list = NULL;
+    }
+    queue->ordered = 0;
+    return chain;
+}
+
+static void queue_migrate(queue_t * queue, int backend){
+    alarm_t * alarm, * next;
+
+    alarm = backend_drain(queue);
+    queue->backend = backend;
+    for(; alarm != NULL; alarm = next){
+        next = alarm->link;
+        backend_insert(queue, alarm);
+    }
+}
+
+/* Put the queue on a backend, moving whatever it holds across, or
+ * with QUEUE_ADAPTIVE let queue_adapt choose from now on.
+ */
+void queue_set_backend(queue_t * queue, int backend){
+    queue->adaptive = backend == QUEUE_ADAPTIVE;
+    if(!queue->adaptive && backend != queue->backend)
+        queue_migrate(queue, backend);
+}
+
+//Alarm due first, or NULL if none are outside staging.
+alarm_t * queue_head(queue_t * queue){
+    switch(queue->backend){
+    case QUEUE_HEAP:
+        return queue->ordered > 0 ? queue->heap[0].alarm : NULL;
+    case QUEUE_WHEEL:
+        return wheel_first(queue);
+    default:
+        return queue->list;
+    }
+}
+
+void queue_init(queue_t * queue, int horizon){
+    memset(queue, 0, sizeof(queue_t));
+    queue->horizon = horizon > 0 ? horizon : 0;
+    queue->backend = QUEUE_LIST;
+    bt_init(&queue->index);
+}
+
+//Free what the queue allocated. The alarms still on it are the caller's.
+void queue_destroy(queue_t * queue){
+    free(queue->heap);
+    queue->heap = NULL;
+    queue->heap_capacity = 0;
+    free(queue->sort);
+    queue->sort = NULL;
+    queue->sort_capacity = 0;
+    bt_destroy(&queue->index);
+}
+
+//Encode a relative time as microseconds past the key base.
+static unsigned int queue_key(queue_t * queue, const struct timespec * time){
+    long long usec;
+
+    usec = (long long)(time->tv_sec - queue->base) * 1000000LL + time->tv_nsec / 1000;
+    //Already due when the base was set
+    if(usec < 0)
+        return 0;
+    if(usec >= QUEUE_KEY_FAR)
+        return QUEUE_KEY_FAR;
+    return usec;
+}
+
+/* Key of an alarm after the base moves delta usec on (back, if
+ * negative).
+ */
+static unsigned int queue_rekey(queue_t * queue, alarm_t * alarm, long long delta){
+    long long key;
+
+    if(alarm->key == QUEUE_KEY_FAR)
+        return queue_key(queue, &alarm->time);
+    key = (long long)alarm->key - delta;
+    if(key < 0)
+        return 0;
+    if(key >= QUEUE_KEY_FAR)
+        return QUEUE_KEY_FAR;
+    return key;
+}
+
+/* Move the key base to base and renumber the list. Keys keep their
+ * order: everything shifts by the same amount, overdue alarms bottom
+ * out at 0, keys pushed out of range become far, and far ones that
+ * now fit were already behind every other key. So the list is
+ * renumbered in place. Alarms bottoming out or going far together
+ * may then tie differently, so the heap is heapified again, and the
+ * wheel slots follow the keys, so it is refilled.
+ */
+static void queue_rebase(queue_t * queue, time_t base){
+    long long delta;
+    alarm_t * alarm, * next;
+    int i;
+
+    delta = (long long)(base - queue->base) * 1000000LL;
+    queue->base = base;
+    switch(queue->backend){
+    case QUEUE_HEAP:
+        for(i = 0; i < queue->ordered; i++){
+            alarm = queue->heap[i].alarm;
+            alarm->key = queue_rekey(queue, alarm, delta);
+            queue->heap[i].key = alarm->key;
+        }
+        for(i = queue->ordered / 2 - 1; i >= 0; i--)
+            heap_down(queue, i, queue->ordered);
+        break;
+    case QUEUE_WHEEL:
+        for(alarm = backend_drain(queue); alarm != NULL; alarm = next){
+            next = alarm->link;
+            alarm->key = queue_rekey(queue, alarm, delta);
+            backend_insert(queue, alarm);
+        }
+        break;
+    default:
+        for(alarm = queue->list; alarm != NULL; alarm = alarm->link)
+            alarm->key = queue_rekey(queue, alarm, delta);
+    }
+}
+
+/* The epoch moved seconds on (back, if negative), so relative now
+ * moved the other way: move the key base with it, so the base never
+ * gets ahead of now and only alarms really due have keys clamped to
+ * 0. Nothing to do before the first rebase sets the base.
+ */
+static void queue_epoch_moved(queue_t * queue, long seconds){
+    if(queue->base != 0)
+        queue_rebase(queue, queue->base - seconds);
+}
+
+//Sort every alarm in bucket due in period or earlier into the list.
+static void queue_promote_bucket(queue_t * queue, int bucket, time_t period){
+    alarm_t * alarm = queue->staged[bucket];
+    alarm_t * next;
+
+    while(alarm != NULL){
+        next = alarm->link;
+        if(alarm->time.tv_sec / queue->horizon <= period){
+            queue_unlink(alarm);
+            alarm->key = queue_key(queue, &alarm->time);
+            alarm->state = ALARM_QUEUED;
+            backend_insert(queue, alarm);
+            queue->staged_count--;
+        }
+        alarm = next;
+    }
+}
+
+/* Move staged alarms onto the list once their period is next, and
+ * rebase the list keys when due.
+ * Cheap when nothing is due, so it can be called every loop.
+ */
+void queue_promote(queue_t * queue, time_t now){
+    time_t target;
+    int bucket;
+
+    //Time stands still for a paused queue
+    if(queue->paused)
+        return;
+
+    //Work in relative time from here on
+    now -= queue->epoch.tv_sec;
+    if(queue->base == 0 || now - queue->base >= QUEUE_REBASE_SECONDS)
+        queue_rebase(queue, now);
+
+    if(queue->horizon == 0)
+        return;
+
+    target = now / queue->horizon + 1;
+    if(target <= queue->promoted)
+        return;
+
+    if(queue->staged_count == 0){
+        queue->promoted = target;
+        return;
+    }
+
+    //Fell behind by a whole lap: sweep every bucket once
+    if(target - queue->promoted >= QUEUE_STAGE_BUCKETS){
+        for(bucket = 0; bucket < QUEUE_STAGE_BUCKETS; bucket++)
+            queue_promote_bucket(queue, bucket, target);
+        queue->promoted = target;
+        return;
+    }
+
+    while(queue->promoted < target){
+        queue->promoted++;
+        queue_promote_bucket(queue, queue->promoted % QUEUE_STAGE_BUCKETS, queue->promoted);
+    }
+}
+
+/* Index an alarm whose time is already relative to the queue.
+ * Returns 1 if it belongs in the backend, with its key set, or 0
+ * once it is staged.
+ */
+static int queue_enter(queue_t * queue, alarm_t * alarm, time_t now){
+    time_t period;
+    long long lead;
+
+    //Workload for queue_adapt
+    lead = (long long)(alarm->time.tv_sec - (now - queue->epoch.tv_sec)) * 1000000LL
+           + alarm->time.tv_nsec / 1000;
+    if(queue->inserts == 0 || lead < queue->lead_min)
+        queue->lead_min = lead;
+    if(queue->inserts == 0 || lead > queue->lead_max)
+        queue->lead_max = lead;
+    queue->inserts++;
+
+    alarm->id_link = queue->ids[alarm->id % QUEUE_ID_BUCKETS];
+    queue->ids[alarm->id % QUEUE_ID_BUCKETS] = alarm;
+    bt_insert(&queue->index, queue_index_key(alarm), alarm);
+    __atomic_add_fetch(&queue->depth, 1, __ATOMIC_RELAXED);
+
+    if(queue->horizon == 0 || (period = alarm->time.tv_sec / queue->horizon) <= queue->promoted){
+        alarm->key = queue_key(queue, &alarm->time);
+        alarm->state = ALARM_QUEUED;
+        return 1;
+    }
+
+    //Far out: push onto the front of its period's bucket
+    queue_push(&queue->staged[period % QUEUE_STAGE_BUCKETS], alarm);
+    alarm->state = ALARM_STAGED;
+    queue->staged_count++;
+    return 0;
+}
+
+void queue_insert(queue_t * queue, alarm_t * alarm, time_t now){
+    queue_promote(queue, now);
+    queue_relative(queue, alarm);
+    if(queue_enter(queue, alarm, now))
+        backend_insert(queue, alarm);
+}
+
+//Room for size alarms in each half of the sort buffer
+static void queue_sort_reserve(queue_t * queue, int size){
+    alarm_t ** grown;
+    int capacity = queue->sort_capacity ? queue->sort_capacity : 64;
+
+    if(size <= queue->sort_capacity)
+        return;
+    while(capacity < size)
+        capacity *= 2;
+    grown = realloc(queue->sort, 2 * capacity * sizeof(alarm_t *));
+    if(grown == NULL)
+        errno_abort("Grow queue sort buffer");
+    queue->sort = grown;
+    queue->sort_capacity = capacity;
+}
+
+//Insertion sort into list order; linear on a batch already nearly in it.
+static void queue_insertion_sort(alarm_t ** alarms, int count){
+    alarm_t * alarm;
+    int i, j;
+
+    for(i = 1; i < count; i++){
+        alarm = alarms[i];
+        for(j = i; j > 0 && queue_before(alarm, alarms[j - 1]); j--)
+            alarms[j] = alarms[j - 1];
+        alarms[j] = alarm;
+    }
+}
+
+//Byte of an alarm's sort digits at shift: the id past lowest under 64, then the key
+static unsigned int queue_radix_digit(alarm_t * alarm, int shift, unsigned long lowest){
+    if(shift < 64)
+        return ((alarm->id - lowest) >> shift) & 0xFF;
+    return (alarm->key >> (shift - 64)) & 0xFF;
+}
+
+/* Sort count alarms into the order the list keeps them in, by LSD
+ * radix sort a byte a pass, using spare as scratch. Every pass is
+ * stable, so sorting on the id first (only if the batch is not in id
+ * order already, and only on the bytes its ids differ in) and then on
+ * the key leaves equal keys in id order without another pass.
+ * Returns whichever of the two arrays ends up sorted.
+ */
+static alarm_t ** queue_radix_sort(alarm_t ** alarms, alarm_t ** spare, int count){
+    int counts[256];
+    alarm_t ** swap;
+    unsigned long lowest, highest;
+    int shift, i, j, total, digit, in_order = 1;
+
+    //Too few to pay for the counting passes
+    if(count < QUEUE_RADIX_MIN){
+        queue_insertion_sort(alarms, count);
+        return alarms;
+    }
+
+    lowest = highest = alarms[0]->id;
+    for(i = 1; i < count; i++){
+        if(alarms[i]->id < alarms[i - 1]->id)
+            in_order = 0;
+        if(alarms[i]->id < lowest)
+            lowest = alarms[i]->id;
+        if(alarms[i]->id > highest)
+            highest = alarms[i]->id;
+    }
+    //The id passes, if any, then the four key passes
+    for(shift = in_order ? 64 : 0; shift < 96; shift += 8){
+        if(shift < 64 && ((highest - lowest) >> shift) == 0)
+            shift = 64;
+        memset(counts, 0, sizeof(counts));
+        for(i = 0; i < count; i++)
+            counts[queue_radix_digit(alarms[i], shift, lowest)]++;
+        //Every alarm shares this byte: the pass would not move anything
+        if(counts[queue_radix_digit(alarms[0], shift, lowest)] == count)
+            continue;
+        for(digit = 0, total = 0; digit < 256; digit++){
+            j = counts[digit];
+            counts[digit] = total;
+            total += j;
+        }
+        for(i = 0; i < count; i++)
+            spare[counts[queue_radix_digit(alarms[i], shift, lowest)]++] = alarms[i];
+        swap = alarms;
+        alarms = spare;
+        spare = swap;
+    }
+
+    //Keys too far out to encode sort last, and among themselves by
+    //their full time. Alarms that far out are rare in a batch
+    for(i = count; i > 0 && alarms[i - 1]->key == QUEUE_KEY_FAR; i--)
+        ;
+    queue_insertion_sort(alarms + i, count - i);
+    return alarms;
+}
+
+/* Merge count alarms, in list order, into the list in one walk.
+ * Each goes before the first alarm it is not due after, as
+ * appendToList would put it.
+ */
+static void queue_merge_list(queue_t * queue, alarm_t ** alarms, int count){
+    alarm_t ** link = &queue->list, * alarm;
+    int i;
+
+    for(i = 0; i < count; i++){
+        alarm = alarms[i];
+        while(*link != NULL && queue_before(*link, alarm))
+            link = &(*link)->link;
+        alarm->link = *link;
+        if(*link != NULL)
+            (*link)->pprev = &alarm->link;
+        alarm->pprev = link;
+        *link = alarm;
+        link = &alarm->link;
+    }
+    queue->ordered += count;
+}
+
+/* Add count alarms to the heap at once. A batch as large as the heap
+ * is cheaper to heapify along with it, bottom up, than to sift up an
+ * entry at a time.
+ */
+static void queue_merge_heap(queue_t * queue, alarm_t ** alarms, int count){
+    int size = queue->ordered + count;
+    int i;
+
+    if(count < queue->ordered){
+        for(i = 0; i < count; i++)
+            backend_insert(queue, alarms[i]);
+        return;
+    }
+    heap_reserve(queue, size);
+    for(i = 0; i < count; i++){
+        queue->heap[queue->ordered + i].key = alarms[i]->key;
+        queue->heap[queue->ordered + i].alarm = alarms[i];
+        alarms[i]->slot = queue->ordered + i;
+    }
+    queue->ordered = size;
+    for(i = size / 2 - 1; i >= 0; i--)
+        heap_down(queue, i, size);
+}
+
+/* queue_insert for count alarms at once, leaving them in the same
+ * order as inserting them one at a time would. Rather than walking
+ * the list once per alarm, the batch is radix sorted and merged into
+ * the list in a single pass. A heap takes a batch as large as itself
+ * by heapifying, and the wheel is O(1) an alarm already, so neither
+ * sorts. The array itself is left as it is.
+ */
+void queue_insert_batch(queue_t * queue, alarm_t ** alarms, int count, time_t now){
+    alarm_t ** sorted;
+    int ready = 0;
+    int i;
+
+    if(count <= 0)
+        return;
+    queue_promote(queue, now);
+    queue_sort_reserve(queue, count);
+    for(i = 0; i < count; i++){
+        queue_relative(queue, alarms[i]);
+        alarms[i]->key = queue_key(queue, &alarms[i]->time);
+        queue->sort[i] = alarms[i];
+    }
+    sorted = queue->sort;
+    if(queue->backend == QUEUE_LIST)
+        sorted = queue_radix_sort(sorted, queue->sort + queue->sort_capacity, count);
+
+    //Those not staged stay in order
+    for(i = 0; i < count; i++)
+        if(queue_enter(queue, sorted[i], now))
+            sorted[ready++] = sorted[i];
+    if(ready == 0)
+        return;
+
+    switch(queue->backend){
+    case QUEUE_HEAP:
+        queue_merge_heap(queue, sorted, ready);
+        break;
+    case QUEUE_WHEEL:
+        for(i = 0; i < ready; i++)
+            backend_insert(queue, sorted[i]);
+        break;
+    default:
+        queue_merge_list(queue, sorted, ready);
+    }
+}
+
+//Remove and return the alarm due first, or NULL if the list is empty.
+alarm_t * queue_pop(queue_t * queue){
+    alarm_t * alarm = queue_head(queue);
+
+    if(alarm == NULL)
+        return NULL;
+
+    backend_remove(queue, alarm);
+    queue_unindex(queue, alarm);
+    bt_remove(&queue->index, queue_index_key(alarm));
+    queue_absolute(queue, alarm);
+    alarm->state = ALARM_UNQUEUED;
+    __atomic_sub_fetch(&queue->depth, 1, __ATOMIC_RELAXED);
+    return alarm;
+}
+
+/* Remove the alarm with this id and return it for the caller to
+ * free, or NULL if it isn't on this queue.
+ */
+alarm_t * queue_cancel(queue_t * queue, unsigned long id){
+    alarm_t ** chain = &queue->ids[id % QUEUE_ID_BUCKETS];
+    alarm_t * alarm;
+
+    while(*chain != NULL && (*chain)->id != id)
+        chain = &(*chain)->id_link;
+    if(*chain == NULL)
+        return NULL;
+
+    alarm = *chain;
+    *chain = alarm->id_link;
+    alarm->id_link = NULL;
+
+    if(alarm->state == ALARM_STAGED){
+        queue->staged_count--;
+        queue_unlink(alarm);
+    } else
+        backend_remove(queue, alarm);
+    queue->cancels++;
+    bt_remove(&queue->index, queue_index_key(alarm));
+    queue_absolute(queue, alarm);
+    alarm->state = ALARM_UNQUEUED;
+    __atomic_sub_fetch(&queue->depth, 1, __ATOMIC_RELAXED);
+    return alarm;
+}
+
+//The queued alarm with this id, left where it is, or NULL.
+alarm_t * queue_find(queue_t * queue, unsigned long id){
+    alarm_t * alarm = queue->ids[id % QUEUE_ID_BUCKETS];
+
+    while(alarm != NULL && alarm->id != id)
+        alarm = alarm->id_link;
+    return alarm;
+}
+
+//Absolute time a queued alarm is due at.
+struct timespec queue_deadline(queue_t * queue, alarm_t * alarm){
+    struct timespec deadline = alarm->time;
+
+    timespec_add(&deadline, &queue->epoch);
+    return deadline;
+}
+
+/* Move every pending alarm seconds later (or earlier, if negative).
+ * The staging periods move with the epoch, so no alarm is moved;
+ * only the keys are renumbered, as the base moves too.
+ */
+void queue_shift(queue_t * queue, long seconds){
+    queue->epoch.tv_sec += seconds;
+    queue_epoch_moved(queue, seconds);
+}
+
+/* Stop the clock for this queue. Nothing on it is due until
+ * queue_resume, which pushes everything back by the time spent paused.
+ */
+void queue_pause(queue_t * queue, struct timespec * now){
+    if(queue->paused)
+        return;
+    queue->paused = 1;
+    queue->paused_at = *now;
+}
+
+void queue_resume(queue_t * queue, struct timespec * now){
+    struct timespec paused_for = *now;
+
+    if(!queue->paused)
+        return;
+    timespec_sub(&paused_for, &queue->paused_at);
+    timespec_add(&queue->epoch, &paused_for);
+    //Whole seconds, rounded up so the base stays behind now
+    queue_epoch_moved(queue, paused_for.tv_sec + (paused_for.tv_nsec > 0));
+    queue->paused = 0;
+}
+
+//Number of queued alarms due at or after from and before to.
+unsigned long queue_range_count(queue_t * queue, const struct timespec * from, const struct timespec * to){
+    bt_key_t low = queue_window_key(queue, from);
+    bt_key_t high = queue_window_key(queue, to);
+
+    if(!(low.when < high.when))
+        return 0;
+    return bt_rank(&queue->index, high) - bt_rank(&queue->index, low);
+}
+
+/* Store up to max queued alarms due in [from, to) into out, soonest
+ * first. Their times are still relative; see queue_deadline.
+ */
+int queue_range_list(queue_t * queue, const struct timespec * from, const struct timespec * to,
+                     alarm_t ** out, int max){
+    bt_key_t low = queue_window_key(queue, from);
+    bt_key_t high = queue_window_key(queue, to);
+
+    return bt_range(&queue->index, low, high, out, max);
+}
+
+/* Cancel every alarm due in [from, to). The cancelled alarms are
+ * returned chained through their link fields, for the caller to free.
+ */
+alarm_t * queue_range_cancel(queue_t * queue, const struct timespec * from, const struct timespec * to){
+    alarm_t * batch[64];
+    alarm_t * cancelled = NULL;
+    int found, i;
+
+    while((found = queue_range_list(queue, from, to, batch, 64)) > 0){
+        for(i = 0; i < found; i++){
+            queue_cancel(queue, batch[i]->id);
+            batch[i]->link = cancelled;
+            cancelled = batch[i];
+        }
+    }
+    return cancelled;
+}
+
+/* In adaptive mode, once a window's worth of workload has been seen,
+ * choose the backend that suits it, and move there if the window
+ * before chose the same, so one odd window doesn't cause a move.
+ * Returns the backend moved off, with why in reason, or -1.
+ */
+int queue_adapt(queue_t * queue, time_t now, char * reason, int size){
+    long long spread = queue->inserts ? queue->lead_max - queue->lead_min : 0;
+    double cancelled;
+    int choice, vote, from = queue->backend;
+
+    if(!queue->adaptive)
+        return -1;
+    if(queue->window_start == 0)
+        queue->window_start = now;
+    if(now - queue->window_start < QUEUE_ADAPT_WINDOW)
+        return -1;
+
+    //Staged alarms only reach the backend a period or two at a time
+    if(queue->horizon > 0 && spread > queue->horizon * 2000000LL)
+        spread = queue->horizon * 2000000LL;
+    cancelled = queue->inserts ? (double)queue->cancels / queue->inserts : 0.0;
+
+    if(queue->ordered <= QUEUE_LIST_LIMIT)
+        choice = QUEUE_LIST;
+    //Nothing new to go on: leave the vote as it was
+    else if(queue->inserts == 0){
+        queue->window_start = now;
+        queue->cancels = 0;
+        return -1;
+    }
+    //Deadlines more than a lap apart share slots; the heap doesn't care
+    else if(spread >= (long long)QUEUE_WHEEL_SLOTS << QUEUE_WHEEL_SHIFT)
+        choice = QUEUE_HEAP;
+    //Crowded slots are only worth scanning if most of them get cancelled first
+    else if(spread >= QUEUE_WHEEL_MIN_SPREAD || cancelled >= 0.5)
+        choice = QUEUE_WHEEL;
+    else
+        choice = QUEUE_HEAP;
+
+    snprintf(reason, size, "%d alarms, deadlines spread over %.1fs, %.0f%% cancelled",
+             queue->ordered, spread / 1e6, cancelled * 100);
+
+    vote = queue->vote;
+    queue->vote = choice;
+    queue->window_start = now;
+    queue->inserts = 0;
+    queue->cancels = 0;
+    if(choice == from || choice != vote)
+        return -1;
+
+    queue_migrate(queue, choice);
+    return from;
+}
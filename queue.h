@@ -0,0 +1,134 @@
+#ifndef __queue_h
+#define __queue_h
+
+#include "alarm.h"
+#include "btree.h"
+
+/*
+ * queue.h
+ *
+ * Per-shard alarm queue. Alarms due within the horizon go on the
+ * ordered list; alarms further out wait, unordered, in a staging
+ * bucket for their horizon-sized period and are only sorted into
+ * the list once that period is next. Alarms cancelled while staged
+ * never touch the ordered list at all.
+ *
+ * While queued, an alarm's time is relative to the queue's epoch, so
+ * moving the epoch shifts every pending alarm at once. Alarms handed
+ * back by queue_pop and queue_cancel have absolute times again.
+ *
+ * An alarm with a spread window (spread_ms) is queued, and fires,
+ * somewhere in the window after its deadline, placed by its id so
+ * that many alarms due together fire evenly across it instead of all
+ * at once. queue_deadline gives the spread time; alarms handed back
+ * have their own deadline again.
+ *
+ * The list sorts on a 32-bit key: microseconds past the queue's key
+ * base, itself a relative time. The base is moved forward every
+ * QUEUE_REBASE_SECONDS, renumbering the list (which staging keeps
+ * short). Deadlines too far out for 32 bits get QUEUE_KEY_FAR and
+ * fall back to comparing their full time. Alarms due at the same
+ * time, on any backend, come off in id order.
+ *
+ * Every queued alarm, staged or not, is also in a counted B+tree by
+ * deadline, for counting, listing and cancelling time windows.
+ *
+ * The alarms that are not staged are kept in one of three backends:
+ * the sorted list, a binary heap of (key, alarm) entries, or a timing
+ * wheel of QUEUE_WHEEL_SLOTS unsorted slots. A list is cheapest while
+ * short, a wheel when deadlines spread out over less than its lap,
+ * and a heap otherwise. In adaptive mode a queue watches its size,
+ * the spread of the deadlines it is given and how many get cancelled,
+ * and moves to whichever backend fits, see queue_adapt.
+ *
+ * A queue is not locked; its owner serialises access.
+ */
+
+#define QUEUE_STAGE_BUCKETS 64
+#define QUEUE_ID_BUCKETS 4096
+#define QUEUE_KEY_FAR 0xFFFFFFFFU
+//Keys cover 2^32 usec, about 71 minutes
+#define QUEUE_REBASE_SECONDS 1800
+
+//Backends for the alarms that are not staged
+#define QUEUE_LIST 0
+#define QUEUE_HEAP 1
+#define QUEUE_WHEEL 2
+#define QUEUE_BACKENDS 3
+//For queue_set_backend: start on the list and adapt
+#define QUEUE_ADAPTIVE QUEUE_BACKENDS
+
+//queue_insert_batch sorts batches smaller than this by insertion
+#define QUEUE_RADIX_MIN 64
+
+//Wheel slots are 2^16 usec, about 65ms, so a lap is about 67 seconds
+#define QUEUE_WHEEL_SLOTS 1024
+#define QUEUE_WHEEL_SHIFT 16
+
+//Adaptive mode: seconds of workload each decision is made on...
+#define QUEUE_ADAPT_WINDOW 5
+//...alarms a list stays the cheapest for...
+#define QUEUE_LIST_LIMIT 64
+//...and the least spread, in usec, that keeps wheel slots short
+#define QUEUE_WHEEL_MIN_SPREAD 1000000LL
+
+typedef struct queue_entry {
+    unsigned int key;
+    alarm_t * alarm;
+} queue_entry_t;
+
+typedef struct alarm_queue {
+    int backend;
+    int ordered;                                /* alarms in the backend */
+    alarm_t * list;                             /* ordered, soonest first */
+    queue_entry_t * heap;
+    int heap_capacity;
+    alarm_t ** sort;                            /* queue_insert_batch scratch, two halves */
+    int sort_capacity;
+    alarm_t * wheel[QUEUE_WHEEL_SLOTS];
+    unsigned int wheel_cursor;                  /* no wheel alarm is in an earlier slot */
+    alarm_t * wheel_first;                      /* cached, NULL if not known */
+    alarm_t * staged[QUEUE_STAGE_BUCKETS];
+    alarm_t * ids[QUEUE_ID_BUCKETS];
+    btree_t index;                              /* every queued alarm by deadline */
+    time_t horizon;                             /* seconds per staging period, 0 disables */
+    time_t promoted;                            /* last period moved onto the list */
+    int depth;                                  /* alarms on the list and staged */
+    int staged_count;
+    struct timespec epoch;                      /* queued times are relative to this */
+    time_t base;                                /* relative time list keys count from */
+    int paused;
+    struct timespec paused_at;
+    //Adaptive mode: workload since window_start
+    int adaptive;
+    time_t window_start;
+    unsigned long inserts;
+    unsigned long cancels;
+    long long lead_min, lead_max;               /* usec from insert to deadline */
+    int vote;                                   /* backend the last window chose */
+} queue_t;
+
+void appendToList(alarm_t ** base_list, alarm_t * new_item);
+
+void queue_init(queue_t * queue, int horizon);
+void queue_destroy(queue_t * queue);
+void queue_set_backend(queue_t * queue, int backend);
+const char * queue_backend_name(int backend);
+int queue_adapt(queue_t * queue, time_t now, char * reason, int size);
+alarm_t * queue_head(queue_t * queue);
+void queue_insert(queue_t * queue, alarm_t * alarm, time_t now);
+void queue_insert_batch(queue_t * queue, alarm_t ** alarms, int count, time_t now);
+void queue_promote(queue_t * queue, time_t now);
+alarm_t * queue_pop(queue_t * queue);
+alarm_t * queue_cancel(queue_t * queue, unsigned long id);
+alarm_t * queue_find(queue_t * queue, unsigned long id);
+struct timespec queue_deadline(queue_t * queue, alarm_t * alarm);
+void queue_shift(queue_t * queue, long seconds);
+void queue_pause(queue_t * queue, struct timespec * now);
+void queue_resume(queue_t * queue, struct timespec * now);
+unsigned long queue_range_count(queue_t * queue, const struct timespec * from, const struct timespec * to);
+int queue_range_list(queue_t * queue, const struct timespec * from, const struct timespec * to,
+                     alarm_t ** out, int max);
+alarm_t * queue_range_cancel(queue_t * queue, const struct timespec * from, const struct timespec * to);
+
+#endif
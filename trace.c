@@ -0,0 +1,252 @@
+/*
+ * trace.c
+ *
+ * Event buffer for the Chrome trace export. Slots are claimed with
+ * an atomic increment and marked ready once filled in, so any thread
+ * can record without taking a lock. When the buffer is full new
+ * events are dropped and counted; the file is written on exit and
+ * on the "trace" command.
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <sys/syscall.h>
+#include "errors.h"
+#include "trace.h"
+#include "flightrec.h"
+
+#define TRACE_MAX_EVENTS (1 << 18)
+#define TRACE_MAX_THREADS 16
+#define TRACE_NAME_SIZE 32
+//Uncontended locks are not worth a slice
+#define TRACE_MIN_WAIT_NS 1000ULL
+
+#define TRACE_KIND_ALARM 0
+#define TRACE_KIND_SLICE 1
+
+typedef struct trace_event {
+    volatile int ready;
+    int kind;
+    int stage;
+    int tid;
+    const char * name;
+    unsigned long id;
+    unsigned long long ts;      /* nanoseconds, CLOCK_MONOTONIC */
+    unsigned long long dur;
+} trace_event_t;
+
+typedef struct trace_thread {
+    int tid;
+    char name[TRACE_NAME_SIZE];
+} trace_thread_t;
+
+int trace_enabled = 0;
+
+static const char * trace_path;
+static int trace_sample;
+static trace_event_t * trace_events;
+static unsigned long trace_next = 0;
+static trace_thread_t trace_threads[TRACE_MAX_THREADS];
+static int trace_thread_count = 0;
+static __thread int trace_tid = 0;
+
+static const char * trace_stage_names[] = { "parse", "dispatch", "enqueue", "fire", "flush" };
+
+static void trace_atexit(void){
+    trace_write();
+}
+
+/* Start tracing one alarm in every sample into path.
+ * The file is rewritten with everything recorded so far each time
+ * trace_write is called.
+ */
+int trace_init(const char * path, int sample){
+    if(sample <= 0)
+        return -1;
+
+    trace_events = calloc(TRACE_MAX_EVENTS, sizeof(trace_event_t));
+    if(trace_events == NULL)
+        return -1;
+
+    trace_path = path;
+    trace_sample = sample;
+    trace_enabled = 1;
+    atexit(trace_atexit);
+    return 0;
+}
+
+static int trace_gettid(void){
+    if(trace_tid == 0)
+        trace_tid = syscall(SYS_gettid);
+    return trace_tid;
+}
+
+//Name the calling thread's track in the trace viewer
+void trace_register_thread(const char * name){
+    int slot;
+
+    if(!trace_enabled)
+        return;
+
+    slot = __atomic_fetch_add(&trace_thread_count, 1, __ATOMIC_ACQ_REL);
+    if(slot >= TRACE_MAX_THREADS)
+        return;
+    snprintf(trace_threads[slot].name, TRACE_NAME_SIZE, "%s", name);
+    __atomic_store_n(&trace_threads[slot].tid, trace_gettid(), __ATOMIC_RELEASE);
+}
+
+//Whether the alarm with this id is part of the sampled subset
+int trace_sampled(unsigned long id){
+    return trace_enabled && id % trace_sample == 0;
+}
+
+unsigned long long trace_now(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void trace_record(int kind, int stage, const char * name,
+                         unsigned long id, unsigned long long start){
+    trace_event_t * event;
+    unsigned long slot;
+    unsigned long long end = trace_now();
+
+    slot = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    if(slot >= TRACE_MAX_EVENTS)
+        return;
+
+    event = &trace_events[slot];
+    event->kind = kind;
+    event->stage = stage;
+    event->tid = trace_gettid();
+    event->name = name;
+    event->id = id;
+    event->ts = start;
+    event->dur = end - start;
+    __atomic_store_n(&event->ready, 1, __ATOMIC_RELEASE);
+}
+
+//Record that alarm id spent start..now in the given stage.
+void trace_alarm(unsigned long id, int stage, unsigned long long start){
+    if(!trace_sampled(id))
+        return;
+    trace_record(TRACE_KIND_ALARM, stage, trace_stage_names[stage], id, start);
+}
+
+//Record an arbitrary slice from start to now on the calling thread.
+void trace_slice(const char * name, unsigned long long start){
+    if(!trace_enabled)
+        return;
+    trace_record(TRACE_KIND_SLICE, 0, name, 0, start);
+}
+
+/* pthread_mutex_lock that records a slice when it had to wait.
+ * The first attempt is a trylock, so uncontended locks cost nothing
+ * extra. Contended waits also go to the flight recorder, traced or not.
+ */
+int trace_lock(pthread_mutex_t * mutex, const char * name){
+    unsigned long long start, waited;
+    int status;
+
+    if(pthread_mutex_trylock(mutex) == 0)
+        return 0;
+
+    start = trace_now();
+    status = pthread_mutex_lock(mutex);
+    waited = trace_now() - start;
+    fr_record(FR_LOCK_WAIT, waited / 1000, (unsigned long)name);
+    if(trace_enabled && waited >= TRACE_MIN_WAIT_NS)
+        trace_record(TRACE_KIND_SLICE, 0, name, 0, start);
+    return status;
+}
+
+/* fflush that records the time spent as a flush slice.
+ * Flushes on behalf of a sampled alarm also close its lifecycle.
+ */
+void trace_flush(FILE * out, unsigned long id){
+    unsigned long long start;
+
+    if(!trace_enabled){
+        fflush(out);
+        return;
+    }
+
+    start = trace_now();
+    fflush(out);
+    if(trace_sampled(id))
+        trace_record(TRACE_KIND_ALARM, TRACE_FLUSH, trace_stage_names[TRACE_FLUSH], id, start);
+    else if(trace_now() - start >= TRACE_MIN_WAIT_NS)
+        trace_record(TRACE_KIND_SLICE, 0, "flush stdout", 0, start);
+}
+
+/* Write everything recorded so far as a Chrome trace-event JSON file.
+ * Each sampled alarm also gets an async track spanning parse to flush,
+ * so its whole lifecycle lines up across threads.
+ */
+int trace_write(void){
+    FILE * out;
+    trace_event_t * event;
+    unsigned long i, count, dropped = 0;
+    int t, threads, first = 1;
+    int pid = getpid();
+
+    if(!trace_enabled)
+        return -1;
+
+    out = fopen(trace_path, "w");
+    if(out == NULL)
+        return -1;
+
+    count = __atomic_load_n(&trace_next, __ATOMIC_RELAXED);
+    if(count > TRACE_MAX_EVENTS){
+        dropped = count - TRACE_MAX_EVENTS;
+        count = TRACE_MAX_EVENTS;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%lu},\"traceEvents\":[\n", dropped);
+
+    threads = __atomic_load_n(&trace_thread_count, __ATOMIC_ACQUIRE);
+    if(threads > TRACE_MAX_THREADS)
+        threads = TRACE_MAX_THREADS;
+    for(t = 0; t < threads; t++){
+        if(__atomic_load_n(&trace_threads[t].tid, __ATOMIC_ACQUIRE) == 0)
+            continue;
+        fprintf(out, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", pid, trace_threads[t].tid, trace_threads[t].name);
+        first = 0;
+    }
+
+    for(i = 0; i < count; i++){
+        event = &trace_events[i];
+        if(!__atomic_load_n(&event->ready, __ATOMIC_ACQUIRE))
+            continue;
+
+        if(event->kind == TRACE_KIND_SLICE){
+            fprintf(out, "%s{\"ph\":\"X\",\"cat\":\"stall\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    first ? "" : ",\n", event->name, pid, event->tid,
+                    event->ts / 1000.0, event->dur / 1000.0);
+            first = 0;
+            continue;
+        }
+
+        fprintf(out, "%s{\"ph\":\"X\",\"cat\":\"alarm\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"id\":%lu}}",
+                first ? "" : ",\n", event->name, pid, event->tid,
+                event->ts / 1000.0, event->dur / 1000.0, event->id);
+        first = 0;
+
+        if(event->stage == TRACE_PARSE)
+            fprintf(out, ",\n{\"ph\":\"b\",\"cat\":\"alarm\",\"name\":\"alarm\",\"id\":%lu,\"pid\":%d,\"ts\":%.3f}",
+                    event->id, pid, event->ts / 1000.0);
+        else if(event->stage == TRACE_FLUSH)
+            fprintf(out, ",\n{\"ph\":\"e\",\"cat\":\"alarm\",\"name\":\"alarm\",\"id\":%lu,\"pid\":%d,\"ts\":%.3f}",
+                    event->id, pid, (event->ts + event->dur) / 1000.0);
+        else
+            fprintf(out, ",\n{\"ph\":\"n\",\"cat\":\"alarm\",\"name\":\"%s\",\"id\":%lu,\"pid\":%d,\"ts\":%.3f}",
+                    event->name, event->id, pid, event->ts / 1000.0);
+    }
+
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    return 0;
+}
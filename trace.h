@@ -0,0 +1,37 @@
+#ifndef __trace_h
+#define __trace_h
+
+#include <pthread.h>
+#include <stdio.h>
+
+/*
+ * trace.h
+ *
+ * Chrome trace-event export of alarm lifecycles. A sampled subset
+ * of alarms records a slice for each pipeline stage, tagged with the
+ * alarm id, and contended mutex waits and stdout flushes are recorded
+ * as slices on the thread that stalled. The buffer is written as JSON
+ * that chrome://tracing and ui.perfetto.dev both load.
+ */
+
+//Alarm lifecycle stages
+#define TRACE_PARSE 0
+#define TRACE_DISPATCH 1
+#define TRACE_ENQUEUE 2
+#define TRACE_FIRE 3
+#define TRACE_FLUSH 4
+
+//Non zero once trace_init has succeeded
+extern int trace_enabled;
+
+int trace_init(const char * path, int sample);
+void trace_register_thread(const char * name);
+int trace_sampled(unsigned long id);
+unsigned long long trace_now(void);
+void trace_alarm(unsigned long id, int stage, unsigned long long start);
+void trace_slice(const char * name, unsigned long long start);
+int trace_lock(pthread_mutex_t * mutex, const char * name);
+void trace_flush(FILE * out, unsigned long id);
+int trace_write(void);
+
+#endif